@@ -0,0 +1,446 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cmath>
+#include <random>
+#include <algorithm>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "MapReduceClient.h"
+#include "MapReduceFramework.h"
+#include "MapReduceFrameworkExt.h"
+
+#define USAGE "Usage: Benchmark [-w workload,...] [-t threads,...] " \
+              "[-n items,...] [-r repeats]"
+#define DEFAULT_WORKLOADS "wordcount,invertedindex,sort,zipf"
+#define DEFAULT_THREADS "1,2,4,8"
+#define DEFAULT_SIZES "10000,100000"
+#define DEFAULT_REPEATS 3
+#define WORDS_PER_LINE 16
+#define VOCABULARY_SIZE 50000
+#define ZIPF_EXPONENT 1.1
+#define RANDOM_SEED 12345
+#define CSV_HEADER "workload,threads,items,repeat,map_shuffle_ns,reduce_ns," \
+                   "total_ns,items_per_sec,peak_rss_kb"
+#define ERROR_MSG_A "Benchmark Failure: "
+#define ERROR_MSG_B " failed."
+#define ERROR_FORK "fork"
+#define ERROR_WAITPID "waitpid"
+#define ERROR_WORKLOAD "unknown workload"
+
+using namespace std;
+
+//input key and value.
+//a line of words, or of numbers for the sort workload
+class benchLine: public k1Base
+{
+    vector<int> words;
+    int doc_id;
+public:
+    benchLine(int id): doc_id(id) {};
+
+    vector<int>& getWords()
+    {
+        return this->words;
+    }
+
+    const vector<int>& getWords() const
+    {
+        return this->words;
+    }
+
+    int getDocId() const
+    {
+        return this->doc_id;
+    }
+
+    bool operator<(const k1Base &other) const
+    {
+        return this->doc_id < ((benchLine&)other).getDocId();
+    }
+};
+
+//intermediate key and value.
+class benchK2: public k2Base, public HashableKey
+{
+    long key;
+public:
+    benchK2(long k): key(k) {};
+
+    long getKey() const
+    {
+        return this->key;
+    }
+
+    bool operator<(const k2Base &other) const
+    {
+        return this->key < ((benchK2&)other).getKey();
+    }
+
+    size_t Hash() const
+    {
+        return this->key;
+    }
+
+    bool operator==(const k2Base &other) const
+    {
+        return this->key == ((benchK2&)other).getKey();
+    }
+};
+
+class benchV2: public v2Base
+{
+    int value;
+public:
+    benchV2(int v): value(v) {};
+
+    int getValue() const
+    {
+        return this->value;
+    }
+};
+
+//output key and value
+class benchK3: public k3Base
+{
+    long key;
+public:
+    benchK3(long k): key(k) {};
+
+    long getKey() const
+    {
+        return this->key;
+    }
+
+    bool operator<(const k3Base &other) const
+    {
+        return this->key < ((benchK3&)other).getKey();
+    }
+};
+
+class benchV3: public v3Base
+{
+    long value;
+public:
+    benchV3(long v): value(v) {};
+
+    long getValue() const
+    {
+        return this->value;
+    }
+};
+
+/*
+ * Counts every word of every line. Used by the wordcount and zipf workloads,
+ * which differ only in how the words are drawn. The counts of a hot word are
+ * summed in parts.
+ */
+class wordCount: public MapReduceBase, public AssociativeReducer
+{
+public:
+    v2Base* Combine(const k2Base *const key, const V2_VEC &vals) const
+    {
+        if(key)
+        {
+
+        }
+        int count = 0;
+        for (v2Base* val : vals)
+        {
+            count += ((benchV2*)val)->getValue();
+        }
+        return new benchV2(count);
+    }
+
+    void Map(const k1Base *const key, const v1Base *const val) const
+    {
+        if(val)
+        {
+
+        }
+        for (int word : ((benchLine*)key)->getWords())
+        {
+            Emit2(MapReduceAlloc<benchK2>(word), MapReduceAlloc<benchV2>(1));
+        }
+    }
+
+    void Reduce(const k2Base *const key, const V2_VEC &vals) const
+    {
+        long count = 0;
+        for (v2Base* val : vals)
+        {
+            count += ((benchV2*)val)->getValue();
+        }
+        Emit3(new benchK3(((benchK2*)key)->getKey()), new benchV3(count));
+    }
+};
+
+/*
+ * Builds the posting list of every word, the output value is the number of
+ * distinct documents the word appears in.
+ */
+class invertedIndex: public MapReduceBase
+{
+public:
+    void Map(const k1Base *const key, const v1Base *const val) const
+    {
+        if(val)
+        {
+
+        }
+        benchLine* line = (benchLine*)key;
+        for (int word : line->getWords())
+        {
+            Emit2(MapReduceAlloc<benchK2>(word),
+                  MapReduceAlloc<benchV2>(line->getDocId()));
+        }
+    }
+
+    void Reduce(const k2Base *const key, const V2_VEC &vals) const
+    {
+        vector<int> postings;
+        for (v2Base* val : vals)
+        {
+            postings.push_back(((benchV2*)val)->getValue());
+        }
+        sort(postings.begin(), postings.end());
+        long distinct = unique(postings.begin(), postings.end()) -
+                        postings.begin();
+        Emit3(new benchK3(((benchK2*)key)->getKey()), new benchV3(distinct));
+    }
+};
+
+/*
+ * Sorts random numbers: the shuffle orders the keys, Reduce writes every
+ * number back as many times as it appeared.
+ */
+class distributedSort: public MapReduceBase
+{
+public:
+    void Map(const k1Base *const key, const v1Base *const val) const
+    {
+        if(val)
+        {
+
+        }
+        for (int number : ((benchLine*)key)->getWords())
+        {
+            Emit2(MapReduceAlloc<benchK2>(number), NULL);
+        }
+    }
+
+    void Reduce(const k2Base *const key, const V2_VEC &vals) const
+    {
+        Emit3(new benchK3(((benchK2*)key)->getKey()),
+              new benchV3(vals.size()));
+    }
+};
+
+/**
+ * Splits a comma separated list.
+ * @param list
+ * @return the items.
+ */
+vector<string> splitList(const string& list)
+{
+    vector<string> items;
+    size_t begin = 0;
+    while (begin <= list.size())
+    {
+        size_t end = list.find(',', begin);
+        if (end == string::npos)
+        {
+            end = list.size();
+        }
+        if (end > begin)
+        {
+            items.push_back(list.substr(begin, end - begin));
+        }
+        begin = end + 1;
+    }
+    return items;
+}
+
+/**
+ * Generates the input of a workload. Every item is a line of words, numbers
+ * or Zipf distributed keys, the same ones on every run.
+ * @param workload
+ * @param items_num
+ * @return the input.
+ */
+IN_ITEMS_VEC makeInput(const string& workload, int items_num)
+{
+    mt19937 generator(RANDOM_SEED);
+    uniform_int_distribution<int> uniform_word(0, VOCABULARY_SIZE - 1);
+    uniform_int_distribution<int> uniform_number(0, 1 << 30);
+    vector<double> zipf_weights;
+    if (workload == "zipf")
+    {
+        for (int i = 1; i <= VOCABULARY_SIZE; i++)
+        {
+            zipf_weights.push_back(1.0 / pow(i, ZIPF_EXPONENT));
+        }
+    }
+    discrete_distribution<int> zipf_word(zipf_weights.begin(),
+                                         zipf_weights.end());
+    IN_ITEMS_VEC input;
+    for (int i = 0; i < items_num; i++)
+    {
+        benchLine* line = new benchLine(i);
+        for (int j = 0; j < WORDS_PER_LINE; j++)
+        {
+            int word;
+            if (workload == "sort")
+            {
+                word = uniform_number(generator);
+            }
+            else if (workload == "zipf")
+            {
+                word = zipf_word(generator);
+            }
+            else
+            {
+                word = uniform_word(generator);
+            }
+            line->getWords().push_back(word);
+        }
+        input.push_back(IN_ITEM(line, nullptr));
+    }
+    return input;
+}
+
+/**
+ * Runs one job of the workload and prints its row. Runs in a process of its
+ * own, so the peak RSS is of this job only.
+ * @param workload
+ * @param threads
+ * @param items_num
+ * @param repeat
+ */
+void runOne(const string& workload, int threads, int items_num, int repeat)
+{
+    wordCount word_count;
+    invertedIndex inverted_index;
+    distributedSort distributed_sort;
+    MapReduceBase* map_reduce;
+    if (workload == "wordcount" || workload == "zipf")
+    {
+        map_reduce = &word_count;
+    }
+    else if (workload == "invertedindex")
+    {
+        map_reduce = &inverted_index;
+    }
+    else if (workload == "sort")
+    {
+        map_reduce = &distributed_sort;
+    }
+    else
+    {
+        cerr << ERROR_MSG_A << ERROR_WORKLOAD << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    IN_ITEMS_VEC input = makeInput(workload, items_num);
+    OUT_ITEMS_VEC output = RunMapReduceFramework(*map_reduce, input, threads,
+                                                 true);
+    JobStats stats = GetLastJobStats();
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    long total = stats.mapShuffleNanos + stats.reduceNanos;
+    double per_sec = total > 0 ? items_num * 1e9 / total : 0;
+    printf("%s,%d,%d,%d,%ld,%ld,%ld,%.0f,%ld\n", workload.c_str(), threads,
+           items_num, repeat, stats.mapShuffleNanos, stats.reduceNanos, total,
+           per_sec, usage.ru_maxrss);
+    for (OUT_ITEM& item : output)
+    {
+        delete item.first;
+        delete item.second;
+    }
+    for (IN_ITEM& item : input)
+    {
+        delete item.first;
+    }
+    ReleaseMapReduceFramework();
+}
+
+/**
+ * Runs every workload with every thread count and input size and prints the
+ * results as CSV, one row per job. The framework also appends its usual
+ * lines to MapReduceFramework.log.
+ * @param argc
+ * @param argv
+ * @return
+ */
+int main(int argc, char *argv[])
+{
+    string workloads = DEFAULT_WORKLOADS;
+    string threads = DEFAULT_THREADS;
+    string sizes = DEFAULT_SIZES;
+    int repeats = DEFAULT_REPEATS;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:t:n:r:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'w':
+                workloads = optarg;
+                break;
+            case 't':
+                threads = optarg;
+                break;
+            case 'n':
+                sizes = optarg;
+                break;
+            case 'r':
+                repeats = atoi(optarg);
+                break;
+            default:
+                cerr << USAGE << endl;
+                exit(EXIT_FAILURE);
+        }
+    }
+    printf("%s\n", CSV_HEADER);
+    fflush(stdout);
+    for (const string& workload : splitList(workloads))
+    {
+        for (const string& size : splitList(sizes))
+        {
+            for (const string& thread : splitList(threads))
+            {
+                for (int repeat = 0; repeat < repeats; repeat++)
+                {
+                    pid_t pid = fork();
+                    if (pid < 0)
+                    {
+                        cerr << ERROR_MSG_A << ERROR_FORK << ERROR_MSG_B
+                             << endl;
+                        exit(EXIT_FAILURE);
+                    }
+                    if (pid == 0)
+                    {
+                        runOne(workload, atoi(thread.c_str()),
+                               atoi(size.c_str()), repeat);
+                        fflush(stdout);
+                        _exit(EXIT_SUCCESS);
+                    }
+                    int status;
+                    if (waitpid(pid, &status, 0) < 0)
+                    {
+                        cerr << ERROR_MSG_A << ERROR_WAITPID << ERROR_MSG_B
+                             << endl;
+                        exit(EXIT_FAILURE);
+                    }
+                    if (!WIFEXITED(status) || WEXITSTATUS(status))
+                    {
+                        exit(EXIT_FAILURE);
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
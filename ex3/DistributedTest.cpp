@@ -0,0 +1,322 @@
+#include <iostream>
+#include <vector>
+#include <map>
+#include <string>
+#include <cstring>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include "MapReduceClient.h"
+#include "MapReduceFramework.h"
+#include "MapReduceFrameworkExt.h"
+
+#define ITEMS_NUM 3000
+#define WORDS_PER_ITEM 20
+#define VOCABULARY_SIZE 997
+#define WORKERS_NUM 3
+#define CRASH_ITEM 1234
+#define CRASH_WORD 17
+#define MARKER_TEMPLATE "/tmp/DistributedTestXXXXXX"
+#define MAP_MARKER "/map"
+#define REDUCE_MARKER "/reduce"
+#define ERROR_MSG_A "DistributedTest Failure: "
+#define ERROR_MSG_B " failed."
+#define ERROR_MKDTEMP "mkdtemp"
+#define ERROR_PLAIN "distributed word count same as on threads"
+#define ERROR_MAP_CRASH "split of a crashed map worker run again"
+#define ERROR_REDUCE_CRASH "partition of a crashed reduce worker run again"
+#define ERROR_DROPPED "split that always crashes dropped"
+
+using namespace std;
+
+// What the Map and Reduce calls do to the worker process that runs them.
+enum CrashMode {NO_CRASH, MAP_CRASH_ONCE, REDUCE_CRASH_ONCE, MAP_CRASH_ALWAYS};
+
+CrashMode crash_mode = NO_CRASH;
+string marker_directory;
+
+/**
+ * Kills the calling worker process the first time it is called with the
+ * given marker, or every time when once is false.
+ * @param marker
+ * @param once
+ */
+void crashWorker(const char* marker, bool once)
+{
+    string path = marker_directory + marker;
+    int fd = open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0600);
+    if (!once || fd >= 0)
+    {
+        kill(getpid(), SIGKILL);
+    }
+    close(fd);
+}
+
+//input key.
+class testItem: public k1Base
+{
+    int item_id;
+public:
+    testItem(int id): item_id(id) {};
+
+    int getItemId() const
+    {
+        return this->item_id;
+    }
+
+    bool operator<(const k1Base &other) const
+    {
+        return this->item_id < ((testItem&)other).getItemId();
+    }
+};
+
+//intermediate key and value.
+class testK2: public k2Base, public Serializable
+{
+    int key;
+public:
+    testK2(int k): key(k) {};
+
+    int getKey() const
+    {
+        return this->key;
+    }
+
+    bool operator<(const k2Base &other) const
+    {
+        return this->key < ((testK2&)other).getKey();
+    }
+
+    void Serialize(string& out) const
+    {
+        out.append((const char*) &this->key, sizeof(this->key));
+    }
+};
+
+class testV2: public v2Base, public Serializable
+{
+public:
+    void Serialize(string& out) const
+    {
+        if(out.empty())
+        {
+
+        }
+    }
+};
+
+//output key and value
+class testK3: public k3Base, public Serializable
+{
+    int key;
+public:
+    testK3(int k): key(k) {};
+
+    int getKey() const
+    {
+        return this->key;
+    }
+
+    bool operator<(const k3Base &other) const
+    {
+        return this->key < ((testK3&)other).getKey();
+    }
+
+    void Serialize(string& out) const
+    {
+        out.append((const char*) &this->key, sizeof(this->key));
+    }
+};
+
+class testV3: public v3Base, public Serializable
+{
+    long value;
+public:
+    testV3(long v): value(v) {};
+
+    long getValue() const
+    {
+        return this->value;
+    }
+
+    void Serialize(string& out) const
+    {
+        out.append((const char*) &this->value, sizeof(this->value));
+    }
+};
+
+/*
+ * Counts the words of every item, and crashes its worker as crash_mode says.
+ */
+class wordCount: public MapReduceBase, public IntermediateFactory,
+                 public OutputFactory
+{
+public:
+    void Map(const k1Base *const key, const v1Base *const val) const
+    {
+        if(val)
+        {
+
+        }
+        int id = ((testItem*)key)->getItemId();
+        if (id == CRASH_ITEM && crash_mode == MAP_CRASH_ONCE)
+        {
+            crashWorker(MAP_MARKER, true);
+        }
+        if (id == CRASH_ITEM && crash_mode == MAP_CRASH_ALWAYS)
+        {
+            crashWorker(MAP_MARKER, false);
+        }
+        for (int i = 0; i < WORDS_PER_ITEM; i++)
+        {
+            Emit2(new testK2((id * 7 + i) % VOCABULARY_SIZE), new testV2());
+        }
+    }
+
+    void Reduce(const k2Base *const key, const V2_VEC &vals) const
+    {
+        int word = ((testK2*)key)->getKey();
+        if (word == CRASH_WORD && crash_mode == REDUCE_CRASH_ONCE)
+        {
+            crashWorker(REDUCE_MARKER, true);
+        }
+        Emit3(new testK3(word), new testV3(vals.size()));
+    }
+
+    k2Base* DeserializeK2(const char* data, size_t size) const
+    {
+        int key;
+        memcpy(&key, data, min(size, sizeof(key)));
+        return new testK2(key);
+    }
+
+    v2Base* DeserializeV2(const char* data, size_t size) const
+    {
+        if(data || size)
+        {
+
+        }
+        return new testV2();
+    }
+
+    k3Base* DeserializeK3(const char* data, size_t size) const
+    {
+        int key;
+        memcpy(&key, data, min(size, sizeof(key)));
+        return new testK3(key);
+    }
+
+    v3Base* DeserializeV3(const char* data, size_t size) const
+    {
+        long value;
+        memcpy(&value, data, min(size, sizeof(value)));
+        return new testV3(value);
+    }
+};
+
+/**
+ * Prints the failure and exits.
+ * @param what
+ */
+void fail(const char* what)
+{
+    cerr << ERROR_MSG_A << what << ERROR_MSG_B << endl;
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Runs the word count and returns the count of every word, the output pairs
+ * are deleted.
+ * @param input
+ * @param distributed
+ * @return
+ */
+map<int, long> runWordCount(IN_ITEMS_VEC& input, bool distributed)
+{
+    wordCount word_count;
+    JobOptions options;
+    options.distributed = distributed;
+    OUT_ITEMS_VEC output = RunMapReduceFramework(word_count, input,
+                                                 WORKERS_NUM, true, options);
+    map<int, long> counts;
+    for (OUT_ITEM& item : output)
+    {
+        counts[((testK3*)item.first)->getKey()] =
+                ((testV3*)item.second)->getValue();
+        delete item.first;
+        delete item.second;
+    }
+    return counts;
+}
+
+/**
+ * Checks that the tasks of distributed workers that crash are handed to new
+ * workers: a split or a partition whose worker crashed once gives the same
+ * output as a job on threads, and a split that always crashes is dropped
+ * after JobOptions::splitRetries while the job still finishes. Used by make
+ * test.
+ * @return
+ */
+int main()
+{
+    char directory[] = MARKER_TEMPLATE;
+    if (mkdtemp(directory) == NULL)
+    {
+        fail(ERROR_MKDTEMP);
+    }
+    marker_directory = directory;
+    IN_ITEMS_VEC input;
+    for (int i = 0; i < ITEMS_NUM; i++)
+    {
+        input.push_back(IN_ITEM(new testItem(i), nullptr));
+    }
+    map<int, long> expected = runWordCount(input, false);
+    if (runWordCount(input, true) != expected)
+    {
+        fail(ERROR_PLAIN);
+    }
+    crash_mode = MAP_CRASH_ONCE;
+    if (runWordCount(input, true) != expected)
+    {
+        fail(ERROR_MAP_CRASH);
+    }
+    crash_mode = REDUCE_CRASH_ONCE;
+    if (runWordCount(input, true) != expected)
+    {
+        fail(ERROR_REDUCE_CRASH);
+    }
+    crash_mode = MAP_CRASH_ALWAYS;
+    map<int, long> dropped = runWordCount(input, true);
+    long expected_total = 0;
+    long dropped_total = 0;
+    for (const pair<const int, long>& count : expected)
+    {
+        expected_total += count.second;
+    }
+    for (const pair<const int, long>& count : dropped)
+    {
+        dropped_total += count.second;
+        if (count.second > expected[count.first])
+        {
+            fail(ERROR_DROPPED);
+        }
+    }
+    if (dropped_total >= expected_total)
+    {
+        fail(ERROR_DROPPED);
+    }
+    string map_marker = marker_directory + MAP_MARKER;
+    string reduce_marker = marker_directory + REDUCE_MARKER;
+    unlink(map_marker.c_str());
+    unlink(reduce_marker.c_str());
+    rmdir(directory);
+    for (IN_ITEM& item : input)
+    {
+        delete item.first;
+    }
+    ReleaseMapReduceFramework();
+    printf("DistributedTest passed\n");
+    return 0;
+}
@@ -0,0 +1,186 @@
+#ifndef EX3_MAPREDUCECLIENTEXT_H
+#define EX3_MAPREDUCECLIENTEXT_H
+
+#include <string>
+#include "MapReduceClient.h"
+
+/*
+ * Optional interfaces a client can implement next to the ones of
+ * MapReduceClient.h, each of them enables a feature of the framework.
+ */
+
+/*
+ * Implemented by the k2 and v2 classes of a client, lets the framework move
+ * intermediate pairs out of memory.
+ */
+class Serializable {
+public:
+    virtual ~Serializable() {}
+    /**
+     * Appends the bytes that represent the object.
+     * @param out
+     */
+    virtual void Serialize(std::string& out) const = 0;
+};
+
+/*
+ * Implemented by the k2 class of a client, lets the shuffle group the values
+ * in a hash table instead of a tree ordered by operator<. Equal keys must
+ * have equal hashes. When the first k2 of a job is a HashableKey, all of them
+ * must be.
+ */
+class HashableKey {
+public:
+    virtual ~HashableKey() {}
+    /**
+     * @return the hash of the key.
+     */
+    virtual size_t Hash() const = 0;
+    /**
+     * @param other a key of the same class.
+     * @return true if the keys are equal.
+     */
+    virtual bool operator==(const k2Base& other) const = 0;
+};
+
+/*
+ * Marks the MapReduceBase of a client whose Map may run more than once on the
+ * same item, at the same time too, with only the pairs of one run kept. Near
+ * the end of the map phase idle mappers then run the chunks that take too
+ * long again, and the first run to finish wins. The pairs and the Emit1
+ * items of the other run are deleted, so only jobs where the framework
+ * deletes k2 and v2 (autoDeleteV2K2) run chunks again.
+ */
+class IdempotentMap {
+public:
+    virtual ~IdempotentMap() {}
+};
+
+/*
+ * Implemented by the MapReduceBase of a client whose input items can be
+ * recognized from one run to the next, lets the cache of the map outputs
+ * (JobOptions::cacheDirectory) skip the items that did not change.
+ */
+class InputFingerprint {
+public:
+    virtual ~InputFingerprint() {}
+    /**
+     * Names an input item and describes its content. The pairs Map emitted
+     * for the item in an earlier run are used again if both are the same.
+     * @param key
+     * @param val
+     * @param name the same for the same item in every run, and different for
+     * items whose Map calls differ.
+     * @param fingerprint changes whenever the pairs Map emits for the item may
+     * change, as the modification time and size of a file.
+     * @return false if the item has to be mapped anyway.
+     */
+    virtual bool Fingerprint(const k1Base* const key, const v1Base* const val,
+                             std::string& name,
+                             std::string& fingerprint) const = 0;
+};
+
+/*
+ * Implemented by the MapReduceBase of a client whose k2 and v2 classes are
+ * Serializable, rebuilds the objects from their bytes. The framework deletes
+ * the objects it rebuilt.
+ */
+class IntermediateFactory {
+public:
+    virtual ~IntermediateFactory() {}
+    /**
+     * @param data bytes that Serialize produced.
+     * @param size number of bytes.
+     * @return a new k2 object.
+     */
+    virtual k2Base* DeserializeK2(const char* data, size_t size) const = 0;
+    /**
+     * @param data bytes that Serialize produced.
+     * @param size number of bytes.
+     * @return a new v2 object.
+     */
+    virtual v2Base* DeserializeV2(const char* data, size_t size) const = 0;
+};
+
+/*
+ * Implemented by the MapReduceBase of a client whose Map adds items with
+ * Emit1, and whose k1 and v1 classes are Serializable, rebuilds the items
+ * from their bytes. Lets the map cache add the items of a call again without
+ * calling Map. The framework deletes the objects it rebuilt.
+ */
+class InputFactory {
+public:
+    virtual ~InputFactory() {}
+    /**
+     * @param data bytes that Serialize produced.
+     * @param size number of bytes.
+     * @return a new k1 object.
+     */
+    virtual k1Base* DeserializeK1(const char* data, size_t size) const = 0;
+    /**
+     * @param data bytes that Serialize produced.
+     * @param size number of bytes.
+     * @return a new v1 object.
+     */
+    virtual v1Base* DeserializeV1(const char* data, size_t size) const = 0;
+};
+
+/*
+ * Implemented by the MapReduceBase of a client whose k3 and v3 classes are
+ * Serializable as well, rebuilds the output of reducers that ran in another
+ * process. The rebuilt objects belong to the client, as the output always
+ * does.
+ */
+class OutputFactory {
+public:
+    virtual ~OutputFactory() {}
+    /**
+     * @param data bytes that Serialize produced.
+     * @param size number of bytes.
+     * @return a new k3 object.
+     */
+    virtual k3Base* DeserializeK3(const char* data, size_t size) const = 0;
+    /**
+     * @param data bytes that Serialize produced.
+     * @param size number of bytes.
+     * @return a new v3 object.
+     */
+    virtual v3Base* DeserializeV3(const char* data, size_t size) const = 0;
+};
+
+/*
+ * Implemented by the MapReduceBase of a client whose Reduce only folds the
+ * values of a key together, so the values can be folded in parts and the
+ * parts folded again. Keys with a huge number of values are then reduced by
+ * all the reduce workers instead of one.
+ */
+class AssociativeReducer {
+public:
+    virtual ~AssociativeReducer() {}
+    /**
+     * Folds some of the values of a key into one value, that Reduce later
+     * gets together with the other parts.
+     * @param key
+     * @param vals
+     * @return a new v2 allocated with new, the framework deletes it.
+     */
+    virtual v2Base* Combine(const k2Base* const key, const V2_VEC& vals) const = 0;
+};
+
+/*
+ * Implemented by the MapReduceBase of every stage of a pipeline but the
+ * first, turns the output of the stage before it into input of this one.
+ */
+class StageInput {
+public:
+    virtual ~StageInput() {}
+    /**
+     * @param key an output key of the previous stage, now owned by this call.
+     * @param value its value, now owned by this call.
+     * @return an input item of this stage. The framework deletes its k1 and
+     * v1 when the stage is done.
+     */
+    virtual IN_ITEM FromPreviousStage(k3Base* key, v3Base* value) const = 0;
+};
+
+#endif //EX3_MAPREDUCECLIENTEXT_H
@@ -3,26 +3,83 @@
 #include <iostream>
 #include <map>
 #include <list>
-#include <semaphore.h>
+#include <deque>
 #include <algorithm>
+#include <atomic>
+#include <future>
+#include <thread>
 #include <sys/time.h>
+#include <unistd.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <libltdl/lt_system.h>
+#include <queue>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <typeinfo>
+#include <cmath>
 #include "MapReduceFramework.h"
+#include "MapReduceFrameworkExt.h"
 
 using namespace std;
 
 //CONSTANTS
-#define SIZE_OF_CHUNK 10
+#define GUIDED_CHUNK_FACTOR 2
 #define SEC_TO_NANOSEC 1000000000
 #define MICRO_TO_NANOSEC 1000
 #define BUFF_SIZE_FOR_TIME 80
+#define ARENA_SLAB_SIZE 65536
+#define ARENA_ALIGNMENT 16
+#define LOG_RING_SIZE 256
+#define PAIR_OVERHEAD_BYTES 64
+#define SPILL_FILE_TEMPLATE "/MapReduceSpillXXXXXX"
+#define CACHE_FILE_PREFIX "/MapReduceCache"
+#define CACHE_TEMP_SUFFIX ".XXXXXX"
+#define CACHE_FORMAT "MapReduceCache2"
+#define CACHE_PAIR_TAG 'p'
+#define CACHE_ITEM_TAG 'i'
+#define CACHE_VALUE_TAG 'v'
+#define SOURCE_BATCH_SIZE 32
+#define SHUFFLE_BATCH_SIZE 1024
+#define SPLITS_PER_PROCESS 4
+#define PARTITION_SEND_BUFFER 65536
+#define HOT_KEY_FACTOR 2
+#define HOT_KEY_MIN_VALUES 1024
+#define MERGE_MIN_RANGE 4096
+#define KEY_TABLE_MIN_SLOTS 1024
+#define STAGE_CHANNEL_CAPACITY 4096
+#define HASH_MULTIPLIER 0x9E3779B97F4A7C15UL
+#define MERGE_SAMPLES_PER_TASK 8
+#define SPECULATION_FACTOR 4
+#define SPECULATION_MIN_NANOS 50000000L
+#define SPECULATION_MAX_ATTEMPTS 2
+#define AUTO_MAX_OVERSUBSCRIPTION 8
+#define AUTO_MIN_SAMPLE_NANOS 10000000L
+#define AUTO_BUSY_TARGET 0.9
+#define SHUFFLE_CPU 0
+#define SEGMENT_FULL_OWNER -1
+#define SEGMENT_GROWTH_FACTOR 2
+#define FNV_OFFSET_BASIS 14695981039346656037UL
+#define FNV_PRIME 1099511628211UL
+#define MSG_MAP 1
+#define MSG_REDUCE 2
+#define MSG_EXIT 3
+#define MSG_MAP_DONE 4
+#define MSG_REDUCE_DONE 5
 #define INIT_FRAMEWORK_MSG "RunMapReduceFramework started with %d threads\n"
 #define CREATE_THREAD_MSG "Thread %s created %s\n"
 #define TERMINATE_THREAD_MSG "Thread %s terminated %s\n"
 #define MAP_SHUFFLE_TIME_MSG "Map and Shuffle took %ld ns\n"
 #define REDUCE_TIME_MSG "Reduce took %ld ns\n"
 #define MAPREDUCE_DONE_MSG "RunMapReduceFramework finished\n"
+#define SPLIT_DROPPED_MSG "Split %d failed and was dropped\n"
+#define LOG_DROPPED_MSG "%lu log records were dropped, the log was full\n"
 #define EXEC_MAP_NAME "ExecMap"
 #define SHUFFLE_NAME "Shuffle"
 #define EXEC_REDUCE_NAME "ExecReduce"
@@ -36,13 +93,35 @@ using namespace std;
 #define ERROR_CREATE "pthread_create"
 #define ERROR_JOIN "pthread_join"
 #define ERROR_GET_TIME "gettimeofday"
+#define ERROR_CPU_TIME "clock_gettime"
+#define ERROR_AFFINITY "pthread_setaffinity_np"
 #define ERROR_OPEN_FILE "open ofstream"
 #define ERROR_CLOSE_FILE "close ofstream"
-#define ERROR_SEMAPHORE_INIT "semaphore_init"
-#define ERROR_SEMAPHORE_DESTORY "semaphore_destory"
-#define ERROR_SEMAPHORE_WAIT "Semaphore_wait"
-#define ERROR_SEMAPHORE_POST "Semaphore_post"
 #define ERROR_FPRINT "fprintf"
+#define ERROR_INIT_COND "pthread_cond_init"
+#define ERROR_DESTROY_COND "pthread_cond_destroy"
+#define ERROR_WAIT_COND "pthread_cond_wait"
+#define ERROR_SIGNAL_COND "pthread_cond_signal"
+#define ERROR_FFLUSH "fflush"
+#define ERROR_MALLOC "malloc"
+#define ERROR_ALLOC_OUTSIDE_MAP "MapReduceAlloc outside of Map"
+#define ERROR_EMIT1 "Emit1 outside of Map of a job on threads"
+#define ERROR_TASKS "RunOnWorkers with a positive number of tasks"
+#define ERROR_MIXED_KEYS "HashableKey for every k2 of the job"
+#define ERROR_PAIR_SIZE "serialized key and value under 4 GiB, write record"
+#define ERROR_SERIALIZABLE "Serializable k2/v2 and IntermediateFactory"
+#define ERROR_SPILL_CREATE "mkstemp"
+#define ERROR_SPILL_WRITE "write spill run"
+#define ERROR_SPILL_READ "read spill run"
+#define ERROR_FINGERPRINT "InputFingerprint for cacheDirectory"
+#define ERROR_CACHE_WRITE "write map cache"
+#define ERROR_OUTPUT_FACTORY "Serializable k3/v3 and OutputFactory"
+#define ERROR_STAGE_INPUT "StageInput of a pipeline stage"
+#define ERROR_MMAP "mmap"
+#define ERROR_FORK "fork"
+#define ERROR_WAITPID "waitpid"
+#define ERROR_SOCKETPAIR "socketpair"
+#define ERROR_POLL "poll"
 
 // Defs
 
@@ -65,51 +144,935 @@ struct compareThreads {
     }
 };
 typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
 typedef pair<k2Base*, v2Base*> MAP_OUTPUT_TYPE;
 typedef list<MAP_OUTPUT_TYPE> MAP_OUTPUT_LIST;
-typedef map<pthread_t, MAP_OUTPUT_LIST, compareThreads> MAP_CONTAINERS;
 typedef pair<k2Base*, std::vector<v2Base*>> SHUFFLE_ITEM;
 typedef map<k2Base*, std::vector<v2Base*>, classcomp> SHUFFLE_LIST;
-typedef map<pthread_t, OUT_ITEMS_VEC, compareThreads> REDUCE_CONTAINERS;
+
+/*
+ * Counts the tasks of one phase that did not finish yet, so the thread that
+ * submitted them can wait for the whole phase.
+ */
+struct TaskGroup {
+    int pending;
+    cond_t done_cond;
+};
+
+/*
+ * One message of the log, kept unformatted until the logger thread prints it.
+ */
+struct LogRecord {
+    unsigned long seq;
+    const char* msg;
+    const char* thread_name;
+    long value;
+    time_t time;
+    int mode;
+};
+
+/*
+ * Ring buffer of log records with a single producer, the thread that owns it,
+ * and a single consumer, whoever holds the drain mutex of the logger. Rings are
+ * never freed, a thread that exits hands its ring over to the next new thread.
+ */
+struct LogRing {
+    LogRecord records[LOG_RING_SIZE];
+    atomic<unsigned long> head;
+    atomic<unsigned long> tail;
+    atomic<bool> in_use;
+    LogRing* next;
+};
+
+/*
+ * Writes the log records to the log file from a background thread, so the
+ * threads of the framework never wait for the file. Records are printed in the
+ * order they were written, by their sequence numbers.
+ */
+class AsyncLogger {
+public:
+    /*
+     * Constructor, opens the log and starts the logger thread.
+     */
+    AsyncLogger();
+    /*
+     * Destructor, stops the logger thread, prints what is left and closes
+     * the log.
+     */
+    ~AsyncLogger();
+    /**
+     * Queues a record in the ring of the calling thread, without locking. When
+     * the ring is full the record is dropped and counted instead, the writer
+     * never prints.
+     * @param record its sequence number is set here.
+     */
+    void write(LogRecord record);
+    /**
+     * Blocks until everything that was written before the call is in the
+     * file.
+     */
+    void flush();
+
+private:
+    /**
+     * Moves the records of all rings to the pending ones and prints those
+     * that are next in order.
+     */
+    void drain();
+    /**
+     * Wakes the logger thread to drain the rings.
+     */
+    void wake();
+    /**
+     * Prints one record with its lazily formatted time.
+     * @param record
+     */
+    void print(const LogRecord& record);
+    /**
+     * The loop of the logger thread.
+     * @param ptr the logger.
+     * @return null.
+     */
+    static void* drainLoop(void* ptr);
+
+    FILE* log_file_p;
+    atomic<unsigned long> next_seq;
+    unsigned long written_seq;
+    vector<LogRecord> pending;
+    mutex_t drain_mutex;
+    pthread_t thread;
+    atomic<bool> stopping;
+    // Set by wake, the logger thread sleeps on wake_cond until it is.
+    bool wake_pending;
+    mutex_t wake_mutex;
+    cond_t wake_cond;
+    // The records that found their ring full since the last drain.
+    atomic<unsigned long> dropped;
+    time_t formatted_time;
+    string formatted_time_str;
+};
+
+/*
+ * Bump allocator for the intermediate objects of one worker. The objects are
+ * carved out of big slabs, each one after a header that tells how to destroy
+ * it, and all of them are destroyed together at the end of the job.
+ */
+class Arena {
+public:
+    /*
+     * Constructor.
+     */
+    Arena();
+    /*
+     * Destructor, destroys the objects that are left and frees the slabs.
+     */
+    ~Arena();
+    /**
+     * Returns memory for a new object.
+     * @param size of the object.
+     * @param destroy function that destroys the object, or NULL.
+     * @return pointer aligned to ARENA_ALIGNMENT.
+     */
+    void* alloc(size_t size, void (*destroy)(void*));
+    /**
+     * Checks if the pointer was returned by this arena, by a binary search of
+     * the slabs.
+     * @param ptr
+     * @return true if it was, else false.
+     */
+    bool owns(const void* ptr) const;
+    /**
+     * Destroys all the objects of the arena. The first slab is kept for the
+     * next job, the others are freed.
+     */
+    void release();
+
+private:
+    /*
+     * Precedes every object in a slab.
+     */
+    struct ObjectHeader {
+        void (*destroy)(void*);
+        size_t size;
+    };
+    struct Slab {
+        char* data;
+        size_t size;
+        size_t used;
+    };
+    /**
+     * Orders the slabs by address.
+     * @param address
+     * @param slab
+     * @return true if the slab starts after the address.
+     */
+    static bool startsAfter(const char* address, const Slab& slab);
+
+    // Sorted by address, objects are allocated from slabs[current].
+    vector<Slab> slabs;
+    size_t current;
+};
+
+/*
+ * A part of the values of a hot key, folded by one Combine call.
+ */
+struct CombinePart {
+    unsigned long group;
+    unsigned long begin;
+    unsigned long end;
+    v2Base* result;
+};
+
+/*
+ * What belongs to one worker thread within one job.
+ */
+struct WorkerState {
+    /*
+     * Constructor, creates the mutex of the container.
+     */
+    WorkerState();
+    /*
+     * Destructor, destroys the mutex of the container.
+     */
+    ~WorkerState();
+
+    // The pairs of the worker that the shuffle did not take yet.
+    MAP_OUTPUT_LIST container;
+    mutex_t container_mutex;
+    OUT_ITEMS_VEC reduce_output;
+    // Where every sorted run of reduce_output starts, one run for every
+    // batch of groups the worker reduced.
+    vector<size_t> output_runs;
+    Arena arena;
+    vector<k2Base*> k2_for_delete;
+    vector<v2Base*> v2_for_delete;
+    // Pairs the mapper emitted and did not hand to the shuffle yet. They go
+    // in batches, or to spilled runs when the job has a memory budget.
+    vector<MAP_OUTPUT_TYPE> pair_buffer;
+    size_t spill_bytes;
+    size_t pair_bytes;
+    bool spilled;
+    bool handed_to_shuffle;
+    // Pairs and Emit1 items of the chunk the mapper runs when the map phase
+    // is speculative.
+    vector<MAP_OUTPUT_TYPE> attempt_pairs;
+    IN_ITEMS_VEC attempt_items;
+    // The serialized pairs and items of the Map call that runs, for the map
+    // cache, and whether the call added items that can't be serialized.
+    string* cache_record;
+    bool uncached_items;
+};
+
+/*
+ * A chunk of the input of a speculative map phase. The first run of the chunk
+ * to finish hands its pairs to the shuffle, the other run drops its own.
+ */
+struct MapChunk {
+    /*
+     * Constructor, for the first run of the chunk that starts now.
+     */
+    MapChunk(const IN_ITEM* items, unsigned long size, long start_nanos);
+
+    // Items of the input vector, or one item that Map added.
+    const IN_ITEM* items;
+    unsigned long size;
+    long start_nanos;
+    // Runs that started and runs that did not finish yet, guarded by the
+    // chunks mutex of the job.
+    int attempts;
+    int running;
+    atomic<bool> done;
+};
+
+/*
+ * Reads the groups of one spilled run back, in key order.
+ */
+class RunReader {
+public:
+    /*
+     * Constructor, rewinds the run.
+     * @param file
+     */
+    RunReader(FILE* file);
+    /*
+     * Destructor, closes the run.
+     */
+    ~RunReader();
+    /**
+     * Reads the next group, rebuilding its key and values.
+     * @return false at the end of the run.
+     */
+    bool next();
+
+    k2Base* key;
+    vector<v2Base*> values;
+    size_t bytes;
+
+private:
+    FILE* file;
+    string buffer;
+};
+
+/*
+ * Merges the spilled runs and the groups the shuffle kept in memory into
+ * groups of equal keys, in key order.
+ */
+class RunMerger {
+public:
+    /*
+     * Constructor.
+     * @param runs the spilled runs, the merger closes them.
+     * @param in_memory the groups of the shuffle.
+     */
+    RunMerger(const vector<FILE*>& runs, SHUFFLE_LIST& in_memory);
+    /*
+     * Destructor.
+     */
+    ~RunMerger();
+    /**
+     * Merges the next key.
+     * @param group the key and all of its values.
+     * @param bytes estimated size of the group.
+     * @return false when all sources are done.
+     */
+    bool next(SHUFFLE_ITEM* group, size_t* bytes);
+
+private:
+    /*
+     * Orders the sources by their current key, smallest on top.
+     */
+    struct SourceComp {
+        RunMerger* merger;
+        bool operator()(int first, int second) const;
+    };
+    /**
+     * @param source index of a source, the in memory groups are the last.
+     * @return the current key of the source.
+     */
+    k2Base* currentKey(int source) const;
+    /**
+     * Moves the source to its next group and puts it back in the heap.
+     * @param source
+     */
+    void advance(int source);
+
+    vector<RunReader*> readers;
+    SHUFFLE_LIST::iterator memory_it;
+    SHUFFLE_LIST::iterator memory_end;
+    priority_queue<int, vector<int>, SourceComp> heap;
+};
+
+/*
+ * Groups the values of the shuffle by key in a flat open addressing table,
+ * for keys that are HashableKey. The groups themselves are kept in a vector,
+ * in the order their keys first came, and the table holds their indexes.
+ */
+class KeyTable {
+public:
+    /*
+     * Constructor.
+     * @param groups where the groups are added.
+     */
+    KeyTable(vector<SHUFFLE_ITEM>& groups);
+    /**
+     * @param key
+     * @param hashable the same key, as a HashableKey.
+     * @return the values of the key, of a new group if it is new.
+     */
+    vector<v2Base*>& find(k2Base* key, const HashableKey* hashable);
+
+private:
+    /*
+     * A used slot holds the index of its group plus one, an empty one zero.
+     */
+    struct Slot {
+        size_t hash;
+        size_t group;
+    };
+    /**
+     * Doubles the table and puts every group back in it.
+     */
+    void grow();
+
+    vector<SHUFFLE_ITEM>& groups;
+    vector<Slot> slots;
+};
+
+/*
+ * Passes the output of one stage of a pipeline to the mappers of the next,
+ * as a bounded queue: the reducers of the stage wait when it is full and the
+ * mappers of the next stage wait when it is empty.
+ */
+class StageChannel: public OutputSink, public InputSource {
+public:
+    /*
+     * Constructor.
+     * @param next the stage that reads the channel.
+     */
+    StageChannel(const StageInput* next);
+    /*
+     * Destructor, deletes the input items that are left.
+     */
+    ~StageChannel();
+    /**
+     * Converts an output pair to an input item of the next stage and queues
+     * it.
+     * @param key
+     * @param value
+     */
+    void Write(k3Base* key, v3Base* value);
+    /**
+     * The queue has its own lock, reducers wait for room one by one.
+     * @return true.
+     */
+    bool ConcurrentWrites() const { return true; }
+    /**
+     * Takes the queued items, waits for some if there are none.
+     * @param batch
+     * @param max_items
+     */
+    void NextBatch(IN_ITEMS_VEC& batch, size_t max_items);
+    /**
+     * Ends the input of the next stage, called when the writing stage is
+     * done.
+     */
+    void close();
+    /**
+     * Stops the queue, called when the next stage was cancelled: its mappers
+     * get no more items, and the writing stage no longer waits for room.
+     */
+    void abandon();
+    /**
+     * Deletes the items that went through the channel, called when the
+     * mappers of the next stage are done, so they are kept only as long as
+     * they are mapped.
+     */
+    void release();
+
+private:
+    const StageInput* next;
+    deque<IN_ITEM> queue;
+    // Every item that was queued and not released yet.
+    IN_ITEMS_VEC items;
+    bool closed;
+    bool abandoned;
+    mutex_t mutex;
+    cond_t changed;
+};
+
+/*
+ * Shared memory that the pairs of one worker process are written to, as
+ * records of the split, the key bytes and the value bytes.
+ */
+struct SegmentHeader {
+    size_t used;
+    size_t capacity;
+};
+
+/*
+ * Shared memory through which the worker processes of one round claim their
+ * splits and report the ones they finished, or the ones whose pairs did not
+ * fit in the segment, as owned by SEGMENT_FULL_OWNER. It is followed by the
+ * splits of the round and by the owner of every split of the phase.
+ */
+struct ProcessControl {
+    atomic<unsigned long> next;
+    unsigned long pending_num;
+    unsigned long* pending;
+    atomic<int>* owners;
+};
+
+/*
+ * Precedes every message between the coordinator and a worker process.
+ */
+struct MessageHeader {
+    uint32_t type;
+    uint32_t id;
+    uint64_t size;
+};
+
+/*
+ * Runs a job on worker processes that it talks to over Unix sockets. It hands
+ * out the map splits, appends the partitions the workers send back for each
+ * split to a file per partition, and then streams every file to a worker to
+ * be reduced, so the coordinator holds one split in memory at most. The task
+ * of a worker that fails is handed to another one, which replaces it.
+ */
+class Coordinator {
+public:
+    /*
+     * Constructor, starts the workers.
+     * @param items the input of the map splits.
+     * @param workers_num
+     * @param partitions_num
+     * @param retries how many times a failed task is handed out again.
+     * @param spill_directory where the files of the partitions are created.
+     */
+    Coordinator(IN_ITEMS_VEC* items, int workers_num,
+                unsigned long partitions_num, int retries,
+                const char* spill_directory);
+    /**
+     * Runs all the tasks of a phase.
+     * @param task_type MSG_MAP or MSG_REDUCE.
+     * @param tasks_num the number of splits, or of partitions.
+     * @param out gets the output of the reduce phase.
+     */
+    void runPhase(uint32_t task_type, unsigned long tasks_num,
+                  OUT_ITEMS_VEC* out);
+    /**
+     * Tells the workers to exit and waits for them, and closes the files of
+     * the partitions.
+     */
+    void stop();
+
+private:
+    struct RemoteWorker {
+        pid_t pid;
+        int fd;
+        bool busy;
+        unsigned long task;
+    };
+    /**
+     * Forks a worker process connected to the coordinator by a socket pair.
+     * @return the new worker.
+     */
+    RemoteWorker spawnWorker();
+    /**
+     * Gives the task of a failed worker back, or drops it, and replaces the
+     * worker.
+     * @param index
+     */
+    void workerFailed(size_t index);
+    /**
+     * Appends the records of a finished split to the files of their
+     * partitions.
+     * @param payload
+     */
+    void keepPartitions(const string& payload);
+    /**
+     * Sends a partition to be reduced, read from its file in pieces.
+     * @param fd the socket of the worker.
+     * @param partition
+     * @return false if the worker is gone.
+     */
+    bool sendPartition(int fd, uint32_t partition);
+
+    IN_ITEMS_VEC* items;
+    vector<RemoteWorker> workers;
+    // The file of every partition, NULL until a split sends records to it
+    // and after it was reduced, and how many bytes it has.
+    vector<FILE*> partitions;
+    vector<uint64_t> partition_sizes;
+    const char* spill_directory;
+    deque<unsigned long> pending;
+    vector<int> attempts;
+    unsigned long tasks_left;
+    int retries;
+    const char* phase_name;
+};
+
+/*
+ * A call of RunOnWorkers for one task.
+ */
+struct WorkerCall {
+    void (*routine)(void*, int);
+    void* arg;
+    int task;
+};
+
+/*
+ * The sorted outputs of the reducers, merged into the output of the job by
+ * tasks that each take one range of keys.
+ */
+struct OutputMerge {
+    vector<OUT_ITEMS_VEC*> runs;
+    // bounds[task][run] is where the range of the task starts in the run.
+    vector<vector<size_t>> bounds;
+    // Where the range of every task starts in the output.
+    vector<size_t> offsets;
+    OUT_ITEMS_VEC* output;
+    // Takes the merged pairs instead of output, when the job has a sink.
+    OutputSink* sink;
+};
+
+/*
+ * A unit of work handed to the worker threads of the framework context.
+ */
+struct Task {
+    void* (*routine)(void*);
+    void* arg;
+    TaskGroup* group;
+};
+
+/*
+ * The synchronization objects of a job. The framework context keeps the ones
+ * of the jobs that ended for the next jobs, so a short job does not pay for
+ * creating and destroying them every time.
+ */
+struct JobSync {
+    mutex_t items_mutex;
+    cond_t items_cond;
+    mutex_t sink_mutex;
+    mutex_t shuffle_mutex;
+    cond_t shuffle_cond;
+    mutex_t spill_mutex;
+    mutex_t input_mutex;
+    mutex_t chunks_mutex;
+    cond_t chunks_cond;
+    mutex_t states_mutex;
+};
+
+/*
+ * The state of one RunMapReduceFramework call. Every job has its own, so
+ * several jobs can run at once on the workers of the framework context. The
+ * tasks of a job get it as their argument, and Emit2 and Emit3 find it through
+ * current_job.
+ */
+class JobContext {
+public:
+    /*
+     * Constructor, takes the synchronization objects of the job from the
+     * framework context.
+     */
+    JobContext();
+    /*
+     * Destructor, gives the synchronization objects back and destroys the
+     * states of the workers, the arenas included.
+     */
+    ~JobContext();
+    /**
+     * Makes this the job of the calling thread, with a state of its own.
+     */
+    void enter();
+    /**
+     * Makes this the job that a Cancel of its control wakes.
+     */
+    void attachControl();
+    /**
+     * Detaches the job from its control and clears the Cancel it got.
+     */
+    void detachControl();
+
+    // Declared first, the mutexes and conditions below refer to it.
+    JobSync* sync;
+    MapReduceBase* map_reduce_base;
+    void* map_arg;
+    // The input when it comes from an InputSource, else NULL.
+    InputSource* input_source;
+    atomic<unsigned long> index_for_reading;
+    atomic<unsigned long> index_for_reduce;
+    atomic<unsigned long> index_for_combine;
+    unsigned long grain_size;
+    int phase_threads;
+    atomic<bool> exec_map_exists;
+    atomic<int> active_mappers;
+    // Set when Map is idempotent, then the chunks of the input are tracked
+    // and the slow ones run again, see speculate.
+    bool speculative;
+    deque<MapChunk> map_chunks;
+    unsigned long items_committed;
+    long committed_nanos;
+    // Items that Map added with Emit1, the ones from next_emitted on were not
+    // mapped yet. Guarded by items_mutex, mappers that are out of items sleep
+    // on items_cond while other mappers, counted in busy_mappers, may still
+    // add some.
+    deque<IN_ITEM> emitted_items;
+    unsigned long next_emitted;
+    int busy_mappers;
+    mutex_t& items_mutex;
+    cond_t& items_cond;
+    bool toDealloc;
+    vector<SHUFFLE_ITEM> shuffle_vec;
+    SHUFFLE_LIST shuffle_output;
+    // Used instead of shuffle_output when hash_keys, fills shuffle_vec.
+    KeyTable key_table;
+    bool keys_checked;
+    bool hash_keys;
+    // The class of the first key when hash_keys, and where its HashableKey
+    // part starts, so keys of that class skip the dynamic_cast.
+    const type_info* key_type;
+    ptrdiff_t hashable_offset;
+    bool sort_output;
+    JobControl* control;
+    OutputSink* output_sink;
+    mutex_t& sink_mutex;
+    size_t limit;
+    bool limit_largest;
+    size_t memory_budget;
+    const char* spill_directory;
+    const char* cache_directory;
+    const InputFingerprint* input_fingerprint;
+    atomic<unsigned long> cached_items;
+    const IntermediateFactory* intermediate_factory;
+    const InputFactory* input_factory;
+    const OutputFactory* output_factory;
+    const AssociativeReducer* associative_reducer;
+    vector<FILE*> spill_runs;
+    bool source_exhausted;
+    vector<CombinePart> combine_parts;
+    unsigned long split_size;
+    JobStats stats;
+    // The shuffle sleeps on shuffle_cond until a mapper hands over a batch,
+    // counted in ready_batches, or exec_map_exists turns false.
+    mutex_t& shuffle_mutex;
+    cond_t& shuffle_cond;
+    unsigned long ready_batches;
+    mutex_t& spill_mutex;
+    mutex_t& input_mutex;
+    // Guards map_chunks and what the runs of the chunks share. Mappers that
+    // wait for a chunk to finish or to turn slow sleep on chunks_cond.
+    mutex_t& chunks_mutex;
+    cond_t& chunks_cond;
+    // Guards worker_states, the shuffle holds it while it goes over them.
+    mutex_t& states_mutex;
+    map<pthread_t, WorkerState*, compareThreads> worker_states;
+    // Set for AUTO_THREAD_LEVEL, then mappers are added while the ones that
+    // run are blocked for much of their time, see addMapperIfBlocked.
+    bool auto_threads;
+    int map_cpus;
+    atomic<int> map_tasks;
+    atomic<int> added_levels;
+    atomic<long> map_wall_nanos;
+    atomic<long> map_cpu_nanos;
+    void* (*map_task)(void*);
+    TaskGroup* map_group;
+};
+
+/*
+ * Owns the worker threads of the framework and the log. It is created by the
+ * first RunMapReduceFramework call and shared by the following ones, also by
+ * jobs that run at the same time, so a job only pays for handing out its map
+ * and reduce tasks.
+ */
+class FrameworkContext {
+public:
+    /*
+     * Constructor, opens the log and creates the synchronization objects.
+     */
+    FrameworkContext();
+    /*
+     * Destructor, stops and joins the workers and destroys what the
+     * constructor created.
+     */
+    ~FrameworkContext();
+    /**
+     * Makes sure the pool has at least the given number of workers.
+     * @param workers_num
+     */
+    void ensureWorkers(int workers_num);
+    /**
+     * Queues a task for the workers and counts it in its group.
+     * @param routine
+     * @param arg
+     * @param group
+     */
+    void submit(void* (*routine)(void*), void* arg, TaskGroup* group);
+    /**
+     * Blocks until all the tasks of the group are done.
+     * @param group
+     */
+    void wait(TaskGroup* group);
+    /**
+     * Pins every worker, the ones that exist and the ones created while a job
+     * that pins runs, to one of the CPUs of the process in turn, leaving
+     * SHUFFLE_CPU to the shuffle when there are other CPUs. Called when a job
+     * that pins starts.
+     */
+    void pinWorkers();
+    /**
+     * Called when a job that pins ends. When no other job that pins runs,
+     * gives the workers back the CPUs they could run on before.
+     */
+    void unpinWorkers();
+    /**
+     * Takes the synchronization objects for a new job, ones that an earlier
+     * job gave back when there are any.
+     * @return
+     */
+    JobSync* acquireSync();
+    /**
+     * Keeps the synchronization objects of a job that ended for the next job.
+     * @param sync
+     */
+    void releaseSync(JobSync* sync);
+
+    AsyncLogger* logger;
+    // The sum of the thread levels of the jobs that run now.
+    int active_levels;
+    // The CPUs the process may run on when the context was created.
+    vector<int> cpus;
+
+private:
+    /**
+     * The loop every worker runs, takes tasks from the queue until the
+     * context is destroyed.
+     * @param ptr the context.
+     * @return null.
+     */
+    static void* workerLoop(void* ptr);
+    /**
+     * Pins a worker to the CPU of its index, and keeps the CPUs it could run
+     * on before. Called with the pool mutex held.
+     * @param index
+     */
+    void pinWorker(size_t index);
+
+    vector<pthread_t> workers;
+    // The jobs that pin and run now, and the CPUs every worker could run on
+    // before they were pinned.
+    int pinning_jobs;
+    vector<cpu_set_t> unpinned_cpus;
+    // The synchronization objects that no job uses now.
+    vector<JobSync*> free_syncs;
+    deque<Task> tasks;
+    mutex_t pool_mutex;
+    cond_t pool_cond;
+    bool stopping;
+};
 
 // GLOBALS
-MapReduceBase* map_reduce_base;
-mutex_t chunks_index_mutex;
-mutex_t init_containers_mutex;
-mutex_t reduce_mutex;
-mutex_t log_file_mutex;
-mutex_t exec_map_exist_mut;
-map<pthread_t, mutex_t> container_mutexes_map;
-
-unsigned long index_for_reading;
-unsigned long index_for_reduce;
-
-bool exec_map_exists;
-bool toDealloc;
-
-MAP_CONTAINERS pthreadToContainer;
-REDUCE_CONTAINERS reduce_containers;
-vector<SHUFFLE_ITEM> shuffle_vec;
-SHUFFLE_LIST shuffle_output;
-vector<k2Base*> k2_for_delete;
-vector<v2Base*> v2_for_delete;
-sem_t semaphore;
-FILE* log_file_p;
+FrameworkContext* framework_context = NULL;
+// Guards the creation of framework_context, its pool size and last_job_stats.
+mutex_t context_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Guards the jobs that the JobControls point to, and their Cancel flags.
+mutex_t control_mutex = PTHREAD_MUTEX_INITIALIZER;
+thread_local JobContext* current_job = NULL;
+thread_local WorkerState* current_worker = NULL;
+atomic<LogRing*> log_rings(NULL);
+SegmentHeader* process_segment = NULL;
+ProcessControl* process_control = NULL;
+// Set in forked worker processes, which have no logger thread and may have
+// been forked while another thread held a lock of the logger, so they never
+// log.
+bool worker_process = false;
+// Set in worker processes, where Emit2 and Emit3 write serialized records.
+void (*emit_record)(const string& key, const string& value) = NULL;
+vector<string>* worker_partitions;
+string* worker_output;
+JobStats last_job_stats = JobStats();
+// How much of their time the mappers of every MapReduceBase class were
+// blocked in its last job, guarded by context_mutex.
+map<string, double> blocked_fractions;
+uint32_t process_split;
 
 // Functions declarations
 void initMutex(mutex_t* mutex);
+void lockMutex(mutex_t* mutex);
+void unlockMutex(mutex_t* mutex);
+void initCond(cond_t* cond);
 void* shuffleWork(void* ptr);
 void* execReduce(void* ptr);
+void* execCombine(void* ptr);
+void splitHotKeys(JobContext* job, TaskGroup* phase_group);
 void* execMap(void* ptr);
+void* execMapFromSource(void* ptr);
+void mapItem(const IN_ITEM& item);
+void finishMapTask();
+void addItem(JobContext* job, const IN_ITEM& item);
+const IN_ITEM* claimEmittedItem(JobContext* job);
+bool nextEmittedItem(JobContext* job, IN_ITEM* item);
+void mapEmittedItems(JobContext* job);
+void signalShuffle(JobContext* job);
+void endMapPhase(JobContext* job);
+long threadCpuNanos();
+int processCpus();
+void chooseThreadLevels(const MapReduceBase& mapReduce, int* map_threads,
+                        int* reduce_threads);
+void observeMapper(JobContext* job, long wall_start, long cpu_start);
+void addMapperIfBlocked(JobContext* job);
+void pinCallingThread(int cpu, cpu_set_t* previous);
+bool nextSourceBatch(InputSource* source, IN_ITEMS_VEC& batch);
+OUT_ITEMS_VEC runJob(MapReduceBase& mapReduce, void* (*map_task)(void*),
+                     void* map_arg, int multiThreadLevel, bool autoDeleteV2K2,
+                     const JobOptions& options);
 bool outputComperator(const OUT_ITEM& first_item, const OUT_ITEM& second_item);
-void openLog();
-string returnCurrentTime();
+bool claimChunk(atomic<unsigned long>* cursor, unsigned long size,
+                unsigned long* begin, unsigned long* end);
+FILE* openLog();
+string formatTime(time_t time_now);
+LogRing* acquireLogRing();
 long returnTimeDelta(timeval before, timeval after);
 void writecontentToFile(const char* msg, const char* thread_name ,
                         int* threads_num, long* time_elapsed, int mode);
-void deallocK2V2();
+void deallocK2V2(JobContext* job);
+void beginJob(int multiThreadLevel);
+void endJob(JobContext* job, int multiThreadLevel);
 void cleanResources();
-int shuffleCycle();
+int shuffleCycle(JobContext* job);
+void groupPair(JobContext* job, const MAP_OUTPUT_TYPE& pair);
+const HashableKey* hashableKey(JobContext* job, const k2Base* key);
+long nowNanos();
+void startControl(JobControl* control);
+void wakeCancelledJob(JobContext* job);
+void serializeOrFail(const void* object, bool is_key, string& out);
+void writeBytes(FILE* file, const string& bytes);
+bool readBytes(FILE* file, string& bytes);
+void bufferForSpill(k2Base* key2, v2Base* value2);
+void spillBuffer();
+void handOverBuffer();
+void handOverPairs(vector<MAP_OUTPUT_TYPE>& pairs);
+void mapThroughCache(const IN_ITEM& item);
+string cachePath(JobContext* job, const string& name);
+bool readCacheFile(const string& path, string& bytes);
+void writeCacheFile(const string& path, const string& bytes);
+void emitCachedPair(const char* key, size_t key_size, const char* value,
+                    size_t value_size, void* arg);
+bool recordItem(k1Base* key1, v1Base* value1, string& record);
+MapChunk* registerChunk(JobContext* job, const IN_ITEM* items,
+                        unsigned long size);
+void runChunkAttempt(JobContext* job, MapChunk* chunk);
+MapChunk* findStraggler(JobContext* job, bool* waiting, long* wake_nanos);
+void waitForChunks(JobContext* job, long wake_nanos);
+void speculate(JobContext* job);
+int runningAttempts(JobContext* job);
+void reduceSpilledRuns(JobContext* job, TaskGroup* phase_group);
+void mergeOutputRange(void* arg, int task);
+void mergeOutputs(JobContext* job, OUT_ITEMS_VEC& output);
+bool limitComperator(bool largest, const OUT_ITEM& first_item,
+                     const OUT_ITEM& second_item);
+void keepInLimit(const OUT_ITEM& item);
+void skipGroupsOverLimit(JobContext* job);
+void mergeLimited(JobContext* job, vector<OUT_ITEMS_VEC*>& runs,
+                  OUT_ITEMS_VEC& output);
+void limitOutput(OUT_ITEMS_VEC& output, const JobOptions& options);
+void serializeOutputOrFail(const void* object, bool is_key, string& out);
+void* mapShared(size_t size);
+void appendRecord(const string& key, const string& value);
+void mapSplit(void* arg, unsigned long split);
+void reduceSplit(void* arg, unsigned long split);
+void runWorkerProcess(ProcessControl* control, SegmentHeader* segment,
+                      int worker, void (*run_split)(void*, unsigned long),
+                      void* arg);
+void runProcessPhase(const char* thread_name, unsigned long splits_num,
+                     void (*run_split)(void*, unsigned long), void* arg,
+                     int processes_num, const JobOptions& options,
+                     vector<SegmentHeader*>& segments, vector<int>& owners);
+void shuffleRecord(const char* key, size_t key_size, const char* value,
+                   size_t value_size, void* arg);
+void outputRecord(const char* key, size_t key_size, const char* value,
+                  size_t value_size, void* arg);
+void readRecords(const vector<SegmentHeader*>& segments,
+                 const vector<int>& owners,
+                 void (*use)(const char*, size_t, const char*, size_t, void*),
+                 void* arg);
+void unmapSegments(vector<SegmentHeader*>& segments);
+OUT_ITEMS_VEC runProcessJob(MapReduceBase& mapReduce, IN_ITEMS_VEC& itemsVec,
+                            int multiThreadLevel, bool autoDeleteV2K2,
+                            const JobOptions& options);
+bool writeFully(int fd, const char* data, size_t size);
+bool readFully(int fd, char* data, size_t size);
+bool sendMessage(int fd, uint32_t type, uint32_t id, const string& payload);
+bool receiveMessage(int fd, MessageHeader* header, string& payload);
+void appendPair(string& bytes, const string& key, const string& value);
+void forEachPair(const string& bytes,
+                 void (*use)(const char*, size_t, const char*, size_t, void*),
+                 void* arg);
+void partitionRecord(const string& key, const string& value);
+void outputBytesRecord(const string& key, const string& value);
+void runRemoteWorker(int fd, IN_ITEMS_VEC* items, unsigned long partitions_num);
+OUT_ITEMS_VEC runDistributedJob(MapReduceBase& mapReduce, IN_ITEMS_VEC& itemsVec,
+                                int multiThreadLevel, bool autoDeleteV2K2,
+                                const JobOptions& options);
 
 // IMPLEMENTATION
 
@@ -128,7 +1091,8 @@ long returnTimeDelta(timeval pre, timeval post)
 }
 
 /**
- * Writes the masseges to the log file.
+ * Writes the masseges to the log file. The message is only queued here, the
+ * logger thread formats and prints it.
  * @param msg
  * @param thread_name
  * @param threads_num
@@ -138,90 +1102,100 @@ long returnTimeDelta(timeval pre, timeval post)
 void writecontentToFile(const char* msg, const char* thread_name ,
                         int* threads_num, long* time_elapsed, int mode)
 {
-    if (pthread_mutex_lock(&log_file_mutex))
+    if (worker_process)
     {
-        cerr << ERROR_MSG_A << ERROR_LOCK_MUTEX <<ERROR_MSG_B << endl;
-        exit(EXIT_FAILURE);
+        return;
     }
+    LogRecord record;
+    record.msg = msg;
+    record.thread_name = thread_name;
+    record.value = 0;
+    record.time = 0;
+    record.mode = mode;
     switch (mode)
     {
         case 0:
-        {
-            if (fprintf(log_file_p, msg, *threads_num) < 0)
-            {
-                cerr << ERROR_MSG_A << ERROR_FPRINT <<ERROR_MSG_B << endl;
-                exit(EXIT_FAILURE);
-            }
-        }
-        break;
+            record.value = *threads_num;
+            break;
         case 1:
-        {
-            string cur_time = returnCurrentTime();
-            string str(thread_name);
-            if (fprintf(log_file_p, msg, str.c_str(), cur_time.c_str()) < 0)
-            {
-                cerr << ERROR_MSG_A << ERROR_FPRINT << ERROR_MSG_B << endl;
-                exit(EXIT_FAILURE);
-            }
-        }
-        break;
+            record.time = time(0);
+            break;
         case 2:
-        {
-            if (fprintf(log_file_p, msg, *time_elapsed) < 0)
-            {
-                cerr << ERROR_MSG_A << ERROR_FPRINT << ERROR_MSG_B << endl;
-                exit(EXIT_FAILURE);
-            }
-        }
-        break;
-        case 3:
-        {
-            if (fprintf(log_file_p, msg) < 0)
-            {
-                cerr << ERROR_MSG_A << ERROR_FPRINT << ERROR_MSG_B << endl;
-                exit(EXIT_FAILURE);
-            }
-        }
-        break;
+            record.value = *time_elapsed;
+            break;
         default:;
     }
-    if (pthread_mutex_unlock(&log_file_mutex))
-    {
-        cerr << ERROR_MSG_A << ERROR_UNLOCK_MUTEX << ERROR_MSG_B << endl;
-        exit(EXIT_FAILURE);
-    }
+    framework_context->logger->write(record);
 }
 
 /**
- * Returns the current time and converts it to string.
+ * Converts the given time to string.
+ * @param time_now
  * @return string that represent the time
  */
-string returnCurrentTime()
+string formatTime(time_t time_now)
 {
-    time_t time_now = time(0);
     struct tm time_struct;
     char buf[BUFF_SIZE_FOR_TIME];
-    time_struct = *localtime(&time_now);
+    localtime_r(&time_now, &time_struct);
     strftime(buf, sizeof(buf), "[%d.%m.%Y %X]", &time_struct);
     return buf;
 }
 
+/**
+ * Returns a ring for the calling thread, one that was left by a thread that
+ * exited if there is such, else a new one.
+ * @return the ring.
+ */
+LogRing* acquireLogRing()
+{
+    for (LogRing* ring = log_rings.load(); ring != NULL; ring = ring->next)
+    {
+        bool free_ring = false;
+        if (ring->in_use.compare_exchange_strong(free_ring, true))
+        {
+            return ring;
+        }
+    }
+    LogRing* ring = new LogRing();
+    ring->head = 0;
+    ring->tail = 0;
+    ring->in_use = true;
+    ring->next = log_rings.load();
+    while (!log_rings.compare_exchange_weak(ring->next, ring));
+    return ring;
+}
+
+/*
+ * Holds the log ring of a thread and gives it back when the thread exits.
+ */
+struct LogRingHolder {
+    LogRing* ring;
+    LogRingHolder(): ring(NULL) {}
+    ~LogRingHolder()
+    {
+        if (ring != NULL)
+        {
+            ring->in_use = false;
+        }
+    }
+};
+
+thread_local LogRingHolder log_ring_holder;
+
 /**
  * Open the file, if exists updates it, if there is a problem in the open,
  * prints an error and exit.
+ * @return the opened log file.
  */
-void openLog(){
-    log_file_p = fopen(LOG_FILE_NAME, "a+");
+FILE* openLog(){
+    FILE* log_file_p = fopen(LOG_FILE_NAME, "a+");
     if (log_file_p == NULL)
     {
         cerr << ERROR_MSG_A << ERROR_OPEN_FILE << ERROR_MSG_B << endl;
         exit(EXIT_FAILURE);
     }
-    if(pthread_mutex_init(&log_file_mutex, NULL))
-    {
-        cerr << ERROR_MSG_A << ERROR_INIT_MUTEX << ERROR_MSG_B << endl;
-        exit(EXIT_FAILURE);
-    }
+    return log_file_p;
 }
 
 /**
@@ -238,455 +1212,4431 @@ void initMutex(mutex_t* mutex)
 }
 
 /**
- * Comparator for the sort of the result, using the operator < of the keys.
- * @param first_item
- * @param second_item
- * @return true according to the operator <.
+ * Locks the given mutex, if there is a problem, prints an error and exit.
+ * @param mutex
  */
-bool outputComperator(const OUT_ITEM& first_item, const OUT_ITEM& second_item)
+void lockMutex(mutex_t* mutex)
 {
-    return (*(first_item.first) < *(second_item.first));
+    if (pthread_mutex_lock(mutex))
+    {
+        cerr << ERROR_MSG_A << ERROR_LOCK_MUTEX << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
 }
 
 /**
- * The map function that the execMap threads runs.
- * @param ptr
- * @return null if everuthing's ok.
+ * Unlocks the given mutex, if there is a problem, prints an error and exit.
+ * @param mutex
  */
-void* execMap(void* ptr)
+void unlockMutex(mutex_t* mutex)
 {
-
-    writecontentToFile(CREATE_THREAD_MSG, EXEC_MAP_NAME, NULL, NULL, 1);
-    if (pthread_mutex_lock(&init_containers_mutex))
-    {
-        cerr << ERROR_MSG_A << ERROR_LOCK_MUTEX << ERROR_MSG_B << endl;
-        exit(EXIT_FAILURE);
-    }
-    if (pthread_mutex_unlock(&init_containers_mutex))
+    if (pthread_mutex_unlock(mutex))
     {
         cerr << ERROR_MSG_A << ERROR_UNLOCK_MUTEX << ERROR_MSG_B << endl;
         exit(EXIT_FAILURE);
     }
-    IN_ITEMS_VEC* in_items_vec;
-    in_items_vec = (IN_ITEMS_VEC*) ptr;
-    while(index_for_reading < in_items_vec->size())
-    {
-        if (pthread_mutex_lock(&chunks_index_mutex))
-        {
-            cerr << ERROR_MSG_A << ERROR_LOCK_MUTEX << ERROR_MSG_B << endl;
-            exit(EXIT_FAILURE);
-        }
-        unsigned long index = index_for_reading;
-        if (index >= in_items_vec->size())
-        {
-            if (pthread_mutex_unlock(&chunks_index_mutex))
-            {
-                cerr << ERROR_MSG_A << ERROR_UNLOCK_MUTEX << ERROR_MSG_B <<endl;
-                exit(EXIT_FAILURE);
-            }
-            break;
-        }
-        index_for_reading += SIZE_OF_CHUNK;
-        if (pthread_mutex_unlock(&chunks_index_mutex))
-        {
-            cerr << ERROR_MSG_A << ERROR_UNLOCK_MUTEX <<ERROR_MSG_B << endl;
-            exit(EXIT_FAILURE);
-        }
-        for (unsigned long i = 0; i < SIZE_OF_CHUNK &&
-                index + i < in_items_vec->size(); i++)
-        {
-            IN_ITEM cur_pair = in_items_vec->at(i + index);
-            map_reduce_base->Map(cur_pair.first, cur_pair.second);
-        }
-    }
-    writecontentToFile(TERMINATE_THREAD_MSG, EXEC_MAP_NAME, NULL, NULL, 1);
-    pthread_exit(NULL);
 }
 
- /**
- * The function that the shuffle thread runs, gets their pairs, shuffles them and creates to each key the list with the
-  * values.
-  * @return
-  */
-int shuffleCycle()
+/**
+ * Initlize the given condition variable, if there is a problem, prints an
+ * error and exit. Timed waits on it take a time of nowNanos.
+ * @param cond
+ */
+void initCond(cond_t* cond)
 {
-    for (MAP_CONTAINERS::iterator it = pthreadToContainer.begin(); it != pthreadToContainer.end(); ++it)
+    pthread_condattr_t attributes;
+    if (pthread_condattr_init(&attributes) ||
+        pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC) ||
+        pthread_cond_init(cond, &attributes) ||
+        pthread_condattr_destroy(&attributes))
     {
-        if(!it->second.empty())
-        {
-            if (pthread_mutex_lock(&container_mutexes_map.at(it->first)))
-            {
-                cerr << ERROR_MSG_A << ERROR_LOCK_MUTEX << ERROR_MSG_B << endl;
-                exit(EXIT_FAILURE);
-            }
-            for (MAP_OUTPUT_TYPE cur_pair : it->second)
-            {
-                shuffle_output[cur_pair.first].push_back(cur_pair.second);
-                if (toDealloc)
-                {
-                    if (cur_pair.first != NULL)
-                    {
-                        k2_for_delete.push_back(cur_pair.first);
-                    }
-                    if (cur_pair.second != NULL)
-                    {
-                        v2_for_delete.push_back(cur_pair.second);
-                    }
-                }
-            }
-            while(!it->second.empty())
-            {
-                it->second.pop_front();
-            }
-            if (pthread_mutex_unlock(&container_mutexes_map.at(it->first)))
-            {
-                cerr << ERROR_MSG_A << ERROR_UNLOCK_MUTEX << ERROR_MSG_B
-                     << endl;
-                exit(EXIT_FAILURE);
-            }
-        }
+        cerr << ERROR_MSG_A << ERROR_INIT_COND << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
     }
-    return 0;
 }
 
-/**
- * While execmap threads exists calss to the shuffle function, and one more time
- * again at the end. Then crestes a vector
- * wuth the items.
- * @param ptr
- * @return null if everythhing's ok.
- */
-void* shuffleWork(void* ptr)
-{
-    if(ptr)
-    {
+// ASYNC LOGGER
 
-    }
-    while (exec_map_exists)
-    {
-        if (sem_wait(&semaphore))
-        {
-            cerr << ERROR_MSG_A << ERROR_SEMAPHORE_WAIT << ERROR_MSG_B << endl;
-            exit(EXIT_FAILURE);
-        }
-        shuffleCycle();
-    }
-    shuffleCycle();
-    for (SHUFFLE_LIST::iterator it = shuffle_output.begin();
-         it != shuffle_output.end(); ++it)
+AsyncLogger::AsyncLogger(): next_seq(0), written_seq(0), stopping(false),
+                            wake_pending(false), dropped(0), formatted_time(0)
+{
+    log_file_p = openLog();
+    initMutex(&drain_mutex);
+    initMutex(&wake_mutex);
+    initCond(&wake_cond);
+    if (pthread_create(&thread, NULL, drainLoop, this))
     {
-        shuffle_vec.push_back(*it);
+        cerr << ERROR_MSG_A << ERROR_CREATE << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
     }
-    writecontentToFile(TERMINATE_THREAD_MSG, SHUFFLE_NAME, NULL, NULL, 1);
-    return NULL;
 }
 
-/**
- * The reduce function that the execReduce threads runs.
- * @param ptr
- * @return null if everithng's ok.
- */
-void* execReduce(void* ptr)
+AsyncLogger::~AsyncLogger()
 {
-    if(ptr)
+    stopping = true;
+    wake();
+    if (pthread_join(thread, NULL))
     {
-
+        cerr << ERROR_MSG_A << ERROR_JOIN << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
     }
-    writecontentToFile(CREATE_THREAD_MSG, EXEC_REDUCE_NAME, NULL, NULL, 1);
-    if (pthread_mutex_lock(&init_containers_mutex))
+    flush();
+    if (pthread_mutex_destroy(&drain_mutex) ||
+        pthread_mutex_destroy(&wake_mutex))
     {
-        cerr << ERROR_MSG_A << ERROR_LOCK_MUTEX << ERROR_MSG_B <<endl;
+        cerr << ERROR_MSG_A << ERROR_DESTROY_MUTEX << ERROR_MSG_B << endl;
         exit(EXIT_FAILURE);
     }
-    if (pthread_mutex_unlock(&init_containers_mutex))
+    if (pthread_cond_destroy(&wake_cond))
     {
-        cerr << ERROR_MSG_A << ERROR_UNLOCK_MUTEX << ERROR_MSG_B << endl;
+        cerr << ERROR_MSG_A << ERROR_DESTROY_COND << ERROR_MSG_B << endl;
         exit(EXIT_FAILURE);
     }
-    while(index_for_reduce < shuffle_vec.size())
+    if (fclose(log_file_p))
     {
-        if (pthread_mutex_lock(&reduce_mutex))
+        cerr << ERROR_MSG_A << ERROR_CLOSE_FILE << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+void AsyncLogger::write(LogRecord record)
+{
+    if (log_ring_holder.ring == NULL)
+    {
+        log_ring_holder.ring = acquireLogRing();
+    }
+    LogRing* ring = log_ring_holder.ring;
+    unsigned long head = ring->head.load(memory_order_relaxed);
+    unsigned long used = head - ring->tail.load(memory_order_acquire);
+    if (used == LOG_RING_SIZE)
+    {
+        // The record gets no sequence number, so the order has no gap.
+        dropped.fetch_add(1, memory_order_relaxed);
+        wake();
+        return;
+    }
+    record.seq = next_seq.fetch_add(1);
+    ring->records[head % LOG_RING_SIZE] = record;
+    ring->head.store(head + 1, memory_order_release);
+    if (used + 1 == LOG_RING_SIZE / 2)
+    {
+        wake();
+    }
+}
+
+void AsyncLogger::wake()
+{
+    lockMutex(&wake_mutex);
+    wake_pending = true;
+    if (pthread_cond_signal(&wake_cond))
+    {
+        cerr << ERROR_MSG_A << ERROR_SIGNAL_COND << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    unlockMutex(&wake_mutex);
+}
+
+void AsyncLogger::flush()
+{
+    unsigned long target = next_seq.load();
+    while (true)
+    {
+        drain();
+        lockMutex(&drain_mutex);
+        bool done = written_seq >= target;
+        unlockMutex(&drain_mutex);
+        if (done)
+        {
+            break;
+        }
+        // A record was numbered but is not in its ring yet.
+        sched_yield();
+    }
+    if (fflush(log_file_p))
+    {
+        cerr << ERROR_MSG_A << ERROR_FFLUSH << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+void AsyncLogger::drain()
+{
+    lockMutex(&drain_mutex);
+    for (LogRing* ring = log_rings.load(); ring != NULL; ring = ring->next)
+    {
+        unsigned long tail = ring->tail.load(memory_order_relaxed);
+        unsigned long head = ring->head.load(memory_order_acquire);
+        for (; tail != head; tail++)
+        {
+            pending.push_back(ring->records[tail % LOG_RING_SIZE]);
+        }
+        ring->tail.store(tail, memory_order_release);
+    }
+    sort(pending.begin(), pending.end(),
+         [](const LogRecord& first, const LogRecord& second)
+         { return first.seq < second.seq; });
+    unsigned long printed = 0;
+    while (printed < pending.size() && pending[printed].seq == written_seq)
+    {
+        print(pending[printed]);
+        printed++;
+        written_seq++;
+    }
+    pending.erase(pending.begin(), pending.begin() + printed);
+    unsigned long dropped_now = dropped.exchange(0);
+    if (dropped_now > 0 &&
+        fprintf(log_file_p, LOG_DROPPED_MSG, dropped_now) < 0)
+    {
+        cerr << ERROR_MSG_A << ERROR_FPRINT << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    unlockMutex(&drain_mutex);
+}
+
+void AsyncLogger::print(const LogRecord& record)
+{
+    int res = 0;
+    switch (record.mode)
+    {
+        case 0:
+            res = fprintf(log_file_p, record.msg, (int) record.value);
+            break;
+        case 1:
+        {
+            if (formatted_time_str.empty() || record.time != formatted_time)
+            {
+                formatted_time = record.time;
+                formatted_time_str = formatTime(record.time);
+            }
+            res = fprintf(log_file_p, record.msg, record.thread_name,
+                          formatted_time_str.c_str());
+        }
+        break;
+        case 2:
+            res = fprintf(log_file_p, record.msg, record.value);
+            break;
+        case 3:
+            res = fprintf(log_file_p, record.msg);
+            break;
+        default:;
+    }
+    if (res < 0)
+    {
+        cerr << ERROR_MSG_A << ERROR_FPRINT << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+void* AsyncLogger::drainLoop(void* ptr)
+{
+    AsyncLogger* logger = (AsyncLogger*) ptr;
+    while (true)
+    {
+        lockMutex(&logger->wake_mutex);
+        while (!logger->wake_pending && !logger->stopping)
+        {
+            if (pthread_cond_wait(&logger->wake_cond, &logger->wake_mutex))
+            {
+                cerr << ERROR_MSG_A << ERROR_WAIT_COND << ERROR_MSG_B << endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        logger->wake_pending = false;
+        unlockMutex(&logger->wake_mutex);
+        // The destructor prints what is left after the thread stops.
+        if (logger->stopping)
+        {
+            return NULL;
+        }
+        logger->drain();
+    }
+}
+
+// ARENA
+
+Arena::Arena(): current(0)
+{
+}
+
+Arena::~Arena()
+{
+    release();
+    if (!slabs.empty())
+    {
+        free(slabs[0].data);
+    }
+}
+
+void* Arena::alloc(size_t size, void (*destroy)(void*))
+{
+    size = (size + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+    size_t needed = sizeof(ObjectHeader) + size;
+    if (slabs.empty() || slabs[current].size - slabs[current].used < needed)
+    {
+        Slab slab;
+        slab.size = max(needed, (size_t)ARENA_SLAB_SIZE);
+        slab.used = 0;
+        slab.data = (char*) aligned_alloc(ARENA_ALIGNMENT, slab.size);
+        if (slab.data == NULL)
+        {
+            cerr << ERROR_MSG_A << ERROR_MALLOC << ERROR_MSG_B << endl;
+            exit(EXIT_FAILURE);
+        }
+        current = upper_bound(slabs.begin(), slabs.end(), slab.data,
+                              startsAfter) - slabs.begin();
+        slabs.insert(slabs.begin() + current, slab);
+    }
+    Slab& slab = slabs[current];
+    ObjectHeader* header = (ObjectHeader*) (slab.data + slab.used);
+    header->destroy = destroy;
+    header->size = size;
+    slab.used += needed;
+    return header + 1;
+}
+
+bool Arena::startsAfter(const char* address, const Slab& slab)
+{
+    return address < slab.data;
+}
+
+bool Arena::owns(const void* ptr) const
+{
+    const char* address = (const char*) ptr;
+    // The last slab that starts at or before the address.
+    vector<Slab>::const_iterator it = upper_bound(
+            slabs.begin(), slabs.end(), address, startsAfter);
+    if (it == slabs.begin())
+    {
+        return false;
+    }
+    --it;
+    return address < it->data + it->used;
+}
+
+void Arena::release()
+{
+    for (Slab& slab : slabs)
+    {
+        size_t offset = 0;
+        while (offset < slab.used)
+        {
+            ObjectHeader* header = (ObjectHeader*) (slab.data + offset);
+            if (header->destroy != NULL)
+            {
+                header->destroy(header + 1);
+            }
+            offset += sizeof(ObjectHeader) + header->size;
+        }
+        slab.used = 0;
+    }
+    for (size_t i = 1; i < slabs.size(); i++)
+    {
+        free(slabs[i].data);
+    }
+    if (slabs.size() > 1)
+    {
+        slabs.resize(1);
+    }
+    current = 0;
+}
+
+/**
+ * Returns memory for an intermediate object from the arena of the calling
+ * worker.
+ * @param size of the object.
+ * @param destroy function that destroys the object, or NULL.
+ * @return the memory.
+ */
+void* AllocIntermediate(size_t size, void (*destroy)(void*))
+{
+    if (current_worker == NULL)
+    {
+        cerr << ERROR_MSG_A << ERROR_ALLOC_OUTSIDE_MAP << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    return current_worker->arena.alloc(size, destroy);
+}
+
+// JOB CONTEXT
+
+WorkerState::WorkerState(): spill_bytes(0), pair_bytes(0), spilled(false),
+                            handed_to_shuffle(false), cache_record(NULL),
+                            uncached_items(false)
+{
+    initMutex(&container_mutex);
+}
+
+WorkerState::~WorkerState()
+{
+    if (pthread_mutex_destroy(&container_mutex))
+    {
+        cerr << ERROR_MSG_A << ERROR_DESTROY_MUTEX << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+JobContext::JobContext(): sync(framework_context->acquireSync()),
+                          map_reduce_base(NULL), map_arg(NULL),
+                          input_source(NULL), index_for_reading(0), index_for_reduce(0),
+                          index_for_combine(0), grain_size(1),
+                          phase_threads(1), exec_map_exists(false),
+                          active_mappers(0), speculative(false),
+                          items_committed(0), committed_nanos(0),
+                          next_emitted(0), busy_mappers(0),
+                          items_mutex(sync->items_mutex),
+                          items_cond(sync->items_cond), toDealloc(false),
+                          key_table(shuffle_vec), keys_checked(false),
+                          hash_keys(false), key_type(NULL),
+                          hashable_offset(0), sort_output(true), control(NULL),
+                          output_sink(NULL), sink_mutex(sync->sink_mutex),
+                          limit(0), limit_largest(false),
+                          memory_budget(0), spill_directory(NULL),
+                          cache_directory(NULL), input_fingerprint(NULL),
+                          cached_items(0), intermediate_factory(NULL),
+                          input_factory(NULL),
+                          output_factory(NULL), associative_reducer(NULL),
+                          source_exhausted(false), split_size(1), stats(),
+                          shuffle_mutex(sync->shuffle_mutex),
+                          shuffle_cond(sync->shuffle_cond), ready_batches(0),
+                          spill_mutex(sync->spill_mutex),
+                          input_mutex(sync->input_mutex),
+                          chunks_mutex(sync->chunks_mutex),
+                          chunks_cond(sync->chunks_cond),
+                          states_mutex(sync->states_mutex),
+                          auto_threads(false), map_cpus(1),
+                          map_tasks(0), added_levels(0), map_wall_nanos(0),
+                          map_cpu_nanos(0), map_task(NULL), map_group(NULL)
+{
+}
+
+JobContext::~JobContext()
+{
+    for (map<pthread_t, WorkerState*, compareThreads>::iterator it =
+            worker_states.begin(); it != worker_states.end(); ++it)
+    {
+        delete it->second;
+    }
+    framework_context->releaseSync(sync);
+}
+
+void JobContext::enter()
+{
+    current_job = this;
+    lockMutex(&states_mutex);
+    WorkerState*& state = worker_states[pthread_self()];
+    if (state == NULL)
+    {
+        state = new WorkerState();
+    }
+    current_worker = state;
+    unlockMutex(&states_mutex);
+}
+
+// FRAMEWORK CONTEXT
+
+FrameworkContext::FrameworkContext(): active_levels(0), pinning_jobs(0),
+                                      stopping(false)
+{
+    logger = new AsyncLogger();
+    initMutex(&pool_mutex);
+    initCond(&pool_cond);
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &set))
+            {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    if (cpus.empty())
+    {
+        for (unsigned int cpu = 0; cpu < max(thread::hardware_concurrency(), 1U);
+             cpu++)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+}
+
+FrameworkContext::~FrameworkContext()
+{
+    lockMutex(&pool_mutex);
+    stopping = true;
+    if (pthread_cond_broadcast(&pool_cond))
+    {
+        cerr << ERROR_MSG_A << ERROR_SIGNAL_COND << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    unlockMutex(&pool_mutex);
+    for (pthread_t worker : workers)
+    {
+        if (pthread_join(worker, NULL))
+        {
+            cerr << ERROR_MSG_A << ERROR_JOIN << ERROR_MSG_B << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (JobSync* sync : free_syncs)
+    {
+        if (pthread_mutex_destroy(&sync->items_mutex) ||
+            pthread_mutex_destroy(&sync->sink_mutex) ||
+            pthread_mutex_destroy(&sync->shuffle_mutex) ||
+            pthread_mutex_destroy(&sync->spill_mutex) ||
+            pthread_mutex_destroy(&sync->input_mutex) ||
+            pthread_mutex_destroy(&sync->chunks_mutex) ||
+            pthread_mutex_destroy(&sync->states_mutex))
+        {
+            cerr << ERROR_MSG_A << ERROR_DESTROY_MUTEX << ERROR_MSG_B << endl;
+            exit(EXIT_FAILURE);
+        }
+        if (pthread_cond_destroy(&sync->items_cond) ||
+            pthread_cond_destroy(&sync->shuffle_cond) ||
+            pthread_cond_destroy(&sync->chunks_cond))
+        {
+            cerr << ERROR_MSG_A << ERROR_DESTROY_COND << ERROR_MSG_B << endl;
+            exit(EXIT_FAILURE);
+        }
+        delete sync;
+    }
+    if (pthread_mutex_destroy(&pool_mutex))
+    {
+        cerr << ERROR_MSG_A << ERROR_DESTROY_MUTEX << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (pthread_cond_destroy(&pool_cond))
+    {
+        cerr << ERROR_MSG_A << ERROR_DESTROY_COND << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    delete logger;
+}
+
+void FrameworkContext::ensureWorkers(int workers_num)
+{
+    lockMutex(&pool_mutex);
+    while ((int)workers.size() < workers_num)
+    {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, workerLoop, this))
+        {
+            cerr << ERROR_MSG_A << ERROR_CREATE << ERROR_MSG_B << endl;
+            exit(EXIT_FAILURE);
+        }
+        workers.push_back(worker);
+        if (pinning_jobs > 0)
+        {
+            pinWorker(workers.size() - 1);
+        }
+    }
+    unlockMutex(&pool_mutex);
+}
+
+void FrameworkContext::pinWorkers()
+{
+    lockMutex(&pool_mutex);
+    if (pinning_jobs++ == 0)
+    {
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            pinWorker(i);
+        }
+    }
+    unlockMutex(&pool_mutex);
+}
+
+void FrameworkContext::unpinWorkers()
+{
+    lockMutex(&pool_mutex);
+    if (--pinning_jobs == 0)
+    {
+        for (size_t i = 0; i < unpinned_cpus.size(); i++)
+        {
+            if (pthread_setaffinity_np(workers[i], sizeof(unpinned_cpus[i]),
+                                       &unpinned_cpus[i]))
+            {
+                cerr << ERROR_MSG_A << ERROR_AFFINITY << ERROR_MSG_B << endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        unpinned_cpus.clear();
+    }
+    unlockMutex(&pool_mutex);
+}
+
+JobSync* FrameworkContext::acquireSync()
+{
+    lockMutex(&pool_mutex);
+    JobSync* sync = NULL;
+    if (!free_syncs.empty())
+    {
+        sync = free_syncs.back();
+        free_syncs.pop_back();
+    }
+    unlockMutex(&pool_mutex);
+    if (sync != NULL)
+    {
+        return sync;
+    }
+    sync = new JobSync();
+    initMutex(&sync->items_mutex);
+    initMutex(&sync->sink_mutex);
+    initMutex(&sync->shuffle_mutex);
+    initMutex(&sync->spill_mutex);
+    initMutex(&sync->input_mutex);
+    initMutex(&sync->chunks_mutex);
+    initMutex(&sync->states_mutex);
+    initCond(&sync->items_cond);
+    initCond(&sync->shuffle_cond);
+    initCond(&sync->chunks_cond);
+    return sync;
+}
+
+void FrameworkContext::releaseSync(JobSync* sync)
+{
+    lockMutex(&pool_mutex);
+    free_syncs.push_back(sync);
+    unlockMutex(&pool_mutex);
+}
+
+void FrameworkContext::pinWorker(size_t index)
+{
+    size_t others = cpus.size() > 1 ? cpus.size() - 1 : 1;
+    int cpu = cpus[(SHUFFLE_CPU + 1 + index % others) % cpus.size()];
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    unpinned_cpus.resize(index + 1);
+    if (pthread_getaffinity_np(workers[index], sizeof(unpinned_cpus[index]),
+                               &unpinned_cpus[index]) ||
+        pthread_setaffinity_np(workers[index], sizeof(set), &set))
+    {
+        cerr << ERROR_MSG_A << ERROR_AFFINITY << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+void FrameworkContext::submit(void* (*routine)(void*), void* arg,
+                              TaskGroup* group)
+{
+    Task task = {routine, arg, group};
+    lockMutex(&pool_mutex);
+    group->pending++;
+    tasks.push_back(task);
+    if (pthread_cond_signal(&pool_cond))
+    {
+        cerr << ERROR_MSG_A << ERROR_SIGNAL_COND << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    unlockMutex(&pool_mutex);
+}
+
+void FrameworkContext::wait(TaskGroup* group)
+{
+    lockMutex(&pool_mutex);
+    while (group->pending > 0)
+    {
+        if (pthread_cond_wait(&group->done_cond, &pool_mutex))
+        {
+            cerr << ERROR_MSG_A << ERROR_WAIT_COND << ERROR_MSG_B << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    unlockMutex(&pool_mutex);
+}
+
+void* FrameworkContext::workerLoop(void* ptr)
+{
+    FrameworkContext* context = (FrameworkContext*) ptr;
+    lockMutex(&context->pool_mutex);
+    while (true)
+    {
+        while (context->tasks.empty() && !context->stopping)
+        {
+            if (pthread_cond_wait(&context->pool_cond, &context->pool_mutex))
+            {
+                cerr << ERROR_MSG_A << ERROR_WAIT_COND << ERROR_MSG_B << endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (context->tasks.empty())
+        {
+            break;
+        }
+        Task task = context->tasks.front();
+        context->tasks.pop_front();
+        unlockMutex(&context->pool_mutex);
+        task.routine(task.arg);
+        lockMutex(&context->pool_mutex);
+        if (--task.group->pending == 0 &&
+            pthread_cond_broadcast(&task.group->done_cond))
+        {
+            cerr << ERROR_MSG_A << ERROR_SIGNAL_COND << ERROR_MSG_B << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    unlockMutex(&context->pool_mutex);
+    return NULL;
+}
+
+/**
+ * Comparator for the sort of the result, using the operator < of the keys.
+ * @param first_item
+ * @param second_item
+ * @return true according to the operator <.
+ */
+bool outputComperator(const OUT_ITEM& first_item, const OUT_ITEM& second_item)
+{
+    return (*(first_item.first) < *(second_item.first));
+}
+
+/**
+ * Claims the next chunk of the items [0, size) by advancing the cursor. The
+ * chunk is a fraction of the work that is left, so it shrinks towards the end
+ * of the phase, but it is never smaller than the grain size.
+ * @param cursor the index of the first item that was not claimed yet.
+ * @param size number of items in the phase.
+ * @param begin first item of the claimed chunk.
+ * @param end one past the last item of the claimed chunk.
+ * @return false if there is nothing left to claim.
+ */
+bool claimChunk(atomic<unsigned long>* cursor, unsigned long size,
+                unsigned long* begin, unsigned long* end)
+{
+    unsigned long seen = cursor->load(memory_order_relaxed);
+    if (seen >= size)
+    {
+        return false;
+    }
+    JobContext* job = current_job;
+    if (job->control != NULL && job->control->IsCancelled())
+    {
+        return false;
+    }
+    unsigned long chunk = (size - seen) /
+                          (GUIDED_CHUNK_FACTOR * job->phase_threads);
+    chunk = max(chunk, job->grain_size);
+    *begin = cursor->fetch_add(chunk);
+    if (*begin >= size)
+    {
+        return false;
+    }
+    *end = min(*begin + chunk, size);
+    return true;
+}
+
+/**
+ * Runs Map on one input item, and spills the pairs of the mapper if they grew
+ * over its share of the memory budget.
+ * @param item
+ */
+void mapItem(const IN_ITEM& item)
+{
+    JobContext* job = current_job;
+    if (job->cache_directory != NULL)
+    {
+        mapThroughCache(item);
+    }
+    else
+    {
+        job->map_reduce_base->Map(item.first, item.second);
+    }
+    if (job->control != NULL)
+    {
+        job->control->itemsMapped.fetch_add(1, memory_order_relaxed);
+    }
+    // Between Map calls no pair of the mapper is still being built.
+    if (job->memory_budget > 0 &&
+        current_worker->spill_bytes > job->memory_budget / job->phase_threads)
+    {
+        spillBuffer();
+    }
+}
+
+/**
+ * Ends a map task, the last mapper lets the shuffle know that no more pairs
+ * will come.
+ */
+void finishMapTask()
+{
+    JobContext* job = current_job;
+    handOverBuffer();
+    writecontentToFile(TERMINATE_THREAD_MSG, EXEC_MAP_NAME, NULL, NULL, 1);
+    if (job->active_mappers.fetch_sub(1) == 1)
+    {
+        endMapPhase(job);
+    }
+}
+
+/**
+ * Adds an item that Map emitted to the input of the job, and wakes a mapper
+ * that waits for one.
+ * @param job
+ * @param item
+ */
+void addItem(JobContext* job, const IN_ITEM& item)
+{
+    lockMutex(&job->items_mutex);
+    job->emitted_items.push_back(item);
+    if (pthread_cond_signal(&job->items_cond))
+    {
+        cerr << ERROR_MSG_A << ERROR_SIGNAL_COND << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    unlockMutex(&job->items_mutex);
+}
+
+/**
+ * Claims the next item that Map emitted, without waiting for one.
+ * @param job
+ * @return the item, it lives as long as the job, or null if there is none.
+ */
+const IN_ITEM* claimEmittedItem(JobContext* job)
+{
+    const IN_ITEM* item = NULL;
+    lockMutex(&job->items_mutex);
+    if (job->next_emitted < job->emitted_items.size())
+    {
+        item = &job->emitted_items[job->next_emitted++];
+    }
+    unlockMutex(&job->items_mutex);
+    return item;
+}
+
+/**
+ * Takes the next item that Map emitted for a mapper that is out of input.
+ * While there is none the mapper sleeps, as long as other mappers still run
+ * and may emit more.
+ * @param job
+ * @param item set to the item.
+ * @return false when no more items will come, the mapper then stops.
+ */
+bool nextEmittedItem(JobContext* job, IN_ITEM* item)
+{
+    lockMutex(&job->items_mutex);
+    while (job->next_emitted == job->emitted_items.size() &&
+           job->busy_mappers > 1 &&
+           (job->control == NULL || !job->control->IsCancelled()))
+    {
+        job->busy_mappers--;
+        if (pthread_cond_wait(&job->items_cond, &job->items_mutex))
+        {
+            cerr << ERROR_MSG_A << ERROR_WAIT_COND << ERROR_MSG_B << endl;
+            exit(EXIT_FAILURE);
+        }
+        job->busy_mappers++;
+    }
+    bool found = job->next_emitted < job->emitted_items.size() &&
+                 (job->control == NULL || !job->control->IsCancelled());
+    if (found)
+    {
+        *item = job->emitted_items[job->next_emitted++];
+    }
+    else
+    {
+        // The mappers that sleep check again whether they are the last ones.
+        job->busy_mappers--;
+        if (pthread_cond_broadcast(&job->items_cond))
+        {
+            cerr << ERROR_MSG_A << ERROR_SIGNAL_COND << ERROR_MSG_B << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    unlockMutex(&job->items_mutex);
+    return found;
+}
+
+/**
+ * Maps the items that Map emitted, for a mapper that is out of input, until
+ * no more will come.
+ * @param job
+ */
+void mapEmittedItems(JobContext* job)
+{
+    IN_ITEM item;
+    while (nextEmittedItem(job, &item))
+    {
+        long wall_start = nowNanos();
+        long cpu_start = threadCpuNanos();
+        mapItem(item);
+        observeMapper(job, wall_start, cpu_start);
+    }
+}
+
+/**
+ * Wakes the shuffle for a batch that a mapper put in its container.
+ * @param job
+ */
+void signalShuffle(JobContext* job)
+{
+    lockMutex(&job->shuffle_mutex);
+    job->ready_batches++;
+    if (pthread_cond_signal(&job->shuffle_cond))
+    {
+        cerr << ERROR_MSG_A << ERROR_SIGNAL_COND << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    unlockMutex(&job->shuffle_mutex);
+}
+
+/**
+ * Lets the shuffle know that no more batches will come, it then takes what is
+ * left in the containers and ends.
+ * @param job
+ */
+void endMapPhase(JobContext* job)
+{
+    lockMutex(&job->shuffle_mutex);
+    job->exec_map_exists = false;
+    if (pthread_cond_signal(&job->shuffle_cond))
+    {
+        cerr << ERROR_MSG_A << ERROR_SIGNAL_COND << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    unlockMutex(&job->shuffle_mutex);
+}
+
+/**
+ * The map function that the execMap threads runs.
+ * @param ptr the job, its input is a vector.
+ * @return null if everuthing's ok.
+ */
+void* execMap(void* ptr)
+{
+    JobContext* job = (JobContext*) ptr;
+    job->enter();
+    writecontentToFile(CREATE_THREAD_MSG, EXEC_MAP_NAME, NULL, NULL, 1);
+    IN_ITEMS_VEC* in_items_vec;
+    in_items_vec = (IN_ITEMS_VEC*) job->map_arg;
+    unsigned long begin;
+    unsigned long end;
+    while (claimChunk(&job->index_for_reading, in_items_vec->size(), &begin, &end))
+    {
+        long wall_start = nowNanos();
+        long cpu_start = threadCpuNanos();
+        if (job->speculative)
+        {
+            runChunkAttempt(job, registerChunk(job, &(*in_items_vec)[begin],
+                                               end - begin));
+        }
+        else
+        {
+            for (unsigned long i = begin; i < end; i++)
+            {
+                mapItem((*in_items_vec)[i]);
+            }
+        }
+        observeMapper(job, wall_start, cpu_start);
+    }
+    if (job->speculative)
+    {
+        speculate(job);
+    }
+    else
+    {
+        mapEmittedItems(job);
+    }
+    finishMapTask();
+    return NULL;
+}
+
+/**
+ * Takes the next batch of the input source, one mapper at a time.
+ * @param source
+ * @param batch
+ * @return false when the source is exhausted.
+ */
+bool nextSourceBatch(InputSource* source, IN_ITEMS_VEC& batch)
+{
+    JobContext* job = current_job;
+    batch.clear();
+    if (job->control != NULL && job->control->IsCancelled())
+    {
+        return false;
+    }
+    lockMutex(&job->input_mutex);
+    if (!job->source_exhausted)
+    {
+        source->NextBatch(batch, max(job->grain_size,
+                                     (unsigned long) SOURCE_BATCH_SIZE));
+        job->source_exhausted = batch.empty();
+    }
+    unlockMutex(&job->input_mutex);
+    return !batch.empty();
+}
+
+/**
+ * The map function that the execMap threads runs when the input comes from an
+ * InputSource.
+ * @param ptr the job, its input is a source.
+ * @return null if everuthing's ok.
+ */
+void* execMapFromSource(void* ptr)
+{
+    JobContext* job = (JobContext*) ptr;
+    job->enter();
+    writecontentToFile(CREATE_THREAD_MSG, EXEC_MAP_NAME, NULL, NULL, 1);
+    InputSource* source = (InputSource*) job->map_arg;
+    IN_ITEMS_VEC batch;
+    while (nextSourceBatch(source, batch))
+    {
+        long wall_start = nowNanos();
+        long cpu_start = threadCpuNanos();
+        for (const IN_ITEM& item : batch)
+        {
+            mapItem(item);
+        }
+        observeMapper(job, wall_start, cpu_start);
+    }
+    mapEmittedItems(job);
+    finishMapTask();
+    return NULL;
+}
+
+// JOB CONTROL
+
+JobControl::JobControl(): itemsMapped(0), pairsEmitted(0), pairsShuffled(0),
+                          keysReduced(0), keysTotal(0), mapStartNanos(0),
+                          reduceStartNanos(0), endNanos(0), cancelled(false),
+                          job(NULL)
+{
+}
+
+JobProgress JobControl::Progress() const
+{
+    JobProgress progress;
+    progress.itemsMapped = itemsMapped;
+    progress.pairsEmitted = pairsEmitted;
+    // Read after the emitted pairs, so the backlog is never negative.
+    progress.shuffleBacklog = progress.pairsEmitted - min(pairsShuffled.load(),
+                                                          progress.pairsEmitted);
+    progress.keysReduced = keysReduced;
+    progress.keysTotal = keysTotal;
+    long map_start = mapStartNanos;
+    long reduce_start = reduceStartNanos;
+    long end = endNanos;
+    long now = nowNanos();
+    progress.mapShuffleNanos = map_start == 0 ? 0 :
+            (reduce_start == 0 ? now : reduce_start) - map_start;
+    progress.reduceNanos = reduce_start == 0 ? 0 :
+            (end == 0 ? now : end) - reduce_start;
+    return progress;
+}
+
+void JobControl::Cancel()
+{
+    lockMutex(&control_mutex);
+    cancelled = true;
+    if (job != NULL)
+    {
+        wakeCancelledJob(job);
+    }
+    unlockMutex(&control_mutex);
+}
+
+bool JobControl::IsCancelled() const
+{
+    return cancelled.load(memory_order_relaxed);
+}
+
+/**
+ * @return the time of the monotonic clock in nano seconds, which steps of the
+ * wall clock do not move.
+ */
+long nowNanos()
+{
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now))
+    {
+        cerr << ERROR_MSG_A << ERROR_CPU_TIME << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    return now.tv_sec * SEC_TO_NANOSEC + now.tv_nsec;
+}
+
+void JobContext::attachControl()
+{
+    lockMutex(&control_mutex);
+    control->job = this;
+    unlockMutex(&control_mutex);
+}
+
+void JobContext::detachControl()
+{
+    lockMutex(&control_mutex);
+    control->job = NULL;
+    control->cancelled = false;
+    unlockMutex(&control_mutex);
+}
+
+/**
+ * Wakes the mappers of a cancelled job that sleep until Emit1 items, other
+ * chunks or the previous stage of a pipeline give them input, so they see
+ * the Cancel.
+ * Called with control_mutex held, which keeps the job alive.
+ * @param job
+ */
+void wakeCancelledJob(JobContext* job)
+{
+    lockMutex(&job->items_mutex);
+    if (pthread_cond_broadcast(&job->items_cond))
+    {
+        cerr << ERROR_MSG_A << ERROR_SIGNAL_COND << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    unlockMutex(&job->items_mutex);
+    lockMutex(&job->chunks_mutex);
+    if (pthread_cond_broadcast(&job->chunks_cond))
+    {
+        cerr << ERROR_MSG_A << ERROR_SIGNAL_COND << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    unlockMutex(&job->chunks_mutex);
+    StageChannel* channel = dynamic_cast<StageChannel*>(job->input_source);
+    if (channel != NULL)
+    {
+        channel->abandon();
+    }
+}
+
+/**
+ * Clears what a previous job left in the control and starts the map phase.
+ * A Cancel that came before the job started is kept.
+ * @param control
+ */
+void startControl(JobControl* control)
+{
+    control->itemsMapped = 0;
+    control->pairsEmitted = 0;
+    control->pairsShuffled = 0;
+    control->keysReduced = 0;
+    control->keysTotal = 0;
+    control->reduceStartNanos = 0;
+    control->endNanos = 0;
+    control->mapStartNanos = nowNanos();
+}
+
+// THREAD LEVEL
+
+/**
+ * @return the CPU time of the calling thread in nano seconds.
+ */
+long threadCpuNanos()
+{
+    struct timespec now;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now))
+    {
+        cerr << ERROR_MSG_A << ERROR_CPU_TIME << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    return now.tv_sec * SEC_TO_NANOSEC + now.tv_nsec;
+}
+
+/**
+ * @return the number of CPUs the process may run on.
+ */
+int processCpus()
+{
+    lockMutex(&context_mutex);
+    if (framework_context == NULL)
+    {
+        framework_context = new FrameworkContext();
+    }
+    int cpus = framework_context->cpus.size();
+    unlockMutex(&context_mutex);
+    return cpus;
+}
+
+/**
+ * Picks the thread levels of a job that asked for AUTO_THREAD_LEVEL. The
+ * reducers get a CPU each. The mappers share the CPUs but the one of the
+ * shuffle, and when the mappers of the last job of the same class were
+ * blocked for some of their time, there are as many more of them as keep the
+ * CPUs busy.
+ * @param mapReduce
+ * @param map_threads
+ * @param reduce_threads
+ */
+void chooseThreadLevels(const MapReduceBase& mapReduce, int* map_threads,
+                        int* reduce_threads)
+{
+    int cpus = processCpus();
+    lockMutex(&context_mutex);
+    double blocked = blocked_fractions[typeid(mapReduce).name()];
+    unlockMutex(&context_mutex);
+    double busy = max(1.0 - blocked, 1.0 / AUTO_MAX_OVERSUBSCRIPTION);
+    *map_threads = (int) ceil(max(cpus - 1, 1) / busy);
+    *reduce_threads = cpus;
+}
+
+/**
+ * Counts the wall time and the CPU time of a chunk a mapper finished, and
+ * with AUTO_THREAD_LEVEL adds a mapper if needed.
+ * @param job
+ * @param wall_start the time the chunk started.
+ * @param cpu_start the CPU time of the mapper when the chunk started.
+ */
+void observeMapper(JobContext* job, long wall_start, long cpu_start)
+{
+    job->map_wall_nanos.fetch_add(nowNanos() - wall_start,
+                                  memory_order_relaxed);
+    job->map_cpu_nanos.fetch_add(threadCpuNanos() - cpu_start,
+                                 memory_order_relaxed);
+    if (job->auto_threads)
+    {
+        addMapperIfBlocked(job);
+    }
+}
+
+/**
+ * Adds a map task, and a worker to run it, when the mappers together keep
+ * the CPUs busy for less than AUTO_BUSY_TARGET of the time, because they are
+ * blocked on reading files for example. A mapper that waits for a CPU counts
+ * as blocked too, so mappers are not added once the CPUs are taken. Called
+ * by a mapper that did not finish yet, so the map phase can't end meanwhile.
+ * @param job
+ */
+void addMapperIfBlocked(JobContext* job)
+{
+    long wall = job->map_wall_nanos.load(memory_order_relaxed);
+    long cpu = job->map_cpu_nanos.load(memory_order_relaxed);
+    if (wall < AUTO_MIN_SAMPLE_NANOS)
+    {
+        return;
+    }
+    double busy = (double) cpu / wall;
+    int mappers = job->map_tasks.load();
+    if (mappers >= job->map_cpus * AUTO_MAX_OVERSUBSCRIPTION ||
+        mappers * busy >= job->map_cpus * AUTO_BUSY_TARGET ||
+        !job->map_tasks.compare_exchange_strong(mappers, mappers + 1))
+    {
+        return;
+    }
+    job->active_mappers.fetch_add(1);
+    job->added_levels.fetch_add(1);
+    lockMutex(&job->items_mutex);
+    job->busy_mappers++;
+    unlockMutex(&job->items_mutex);
+    lockMutex(&context_mutex);
+    framework_context->active_levels++;
+    framework_context->ensureWorkers(framework_context->active_levels);
+    unlockMutex(&context_mutex);
+    framework_context->submit(job->map_task, job, job->map_group);
+}
+
+/**
+ * Pins the calling thread to a CPU.
+ * @param cpu
+ * @param previous set to the CPUs the thread could run on before.
+ */
+void pinCallingThread(int cpu, cpu_set_t* previous)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_getaffinity_np(pthread_self(), sizeof(*previous), previous) ||
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+    {
+        cerr << ERROR_MSG_A << ERROR_AFFINITY << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+// MAP CACHE
+
+/**
+ * Maps an item of a job with a cache directory. If the cache has a file of
+ * the item with the same fingerprint, its pairs and the items Map added are
+ * rebuilt and emitted instead of calling Map. Otherwise Map runs and its
+ * pairs and items are written to the file of the item for the next run,
+ * unless an item can't be rebuilt.
+ * @param item
+ */
+void mapThroughCache(const IN_ITEM& item)
+{
+    JobContext* job = current_job;
+    string name;
+    string fingerprint;
+    if (!job->input_fingerprint->Fingerprint(item.first, item.second, name,
+                                             fingerprint))
+    {
+        job->map_reduce_base->Map(item.first, item.second);
+        return;
+    }
+    string path = cachePath(job, name);
+    // The file starts with the format, the name and the fingerprint, then the
+    // pairs and the items, each tagged.
+    string record;
+    appendPair(record, CACHE_FORMAT + name, fingerprint);
+    string bytes;
+    if (readCacheFile(path, bytes) && bytes.size() >= record.size() &&
+        bytes.compare(0, record.size(), record) == 0)
+    {
+        bytes.erase(0, record.size());
+        forEachPair(bytes, emitCachedPair, job);
+        job->cached_items.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    current_worker->cache_record = &record;
+    current_worker->uncached_items = false;
+    job->map_reduce_base->Map(item.first, item.second);
+    current_worker->cache_record = NULL;
+    // Items that can't be rebuilt would be missing when the file is used.
+    if (!current_worker->uncached_items)
+    {
+        writeCacheFile(path, record);
+    }
+}
+
+/**
+ * @param job
+ * @param name the name of an item, as InputFingerprint gave it.
+ * @return the path of the cache file of the item, named by the hash of its
+ * name. Items whose hashes collide replace each other's file.
+ */
+string cachePath(JobContext* job, const string& name)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (char byte : name)
+    {
+        hash = (hash ^ (unsigned char) byte) * FNV_PRIME;
+    }
+    char hex[2 * sizeof(hash) + 1];
+    snprintf(hex, sizeof(hex), "%016lx", (unsigned long) hash);
+    return string(job->cache_directory) + CACHE_FILE_PREFIX + hex;
+}
+
+/**
+ * Reads a whole cache file.
+ * @param path
+ * @param bytes
+ * @return false if the file could not be read, as when it does not exist.
+ */
+bool readCacheFile(const string& path, string& bytes)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == NULL)
+    {
+        return false;
+    }
+    bool read = fseek(file, 0, SEEK_END) == 0;
+    long size = read ? ftell(file) : -1;
+    read = size >= 0 && fseek(file, 0, SEEK_SET) == 0;
+    if (read)
+    {
+        bytes.resize(size);
+        read = size == 0 || fread(&bytes[0], 1, size, file) == (size_t) size;
+    }
+    fclose(file);
+    return read;
+}
+
+/**
+ * Replaces a cache file. The bytes go to a temporary file first that is then
+ * renamed, so a job that reads the file, or that crashes meanwhile, never
+ * sees half of it.
+ * @param path
+ * @param bytes
+ */
+void writeCacheFile(const string& path, const string& bytes)
+{
+    string temp_path = path + CACHE_TEMP_SUFFIX;
+    int fd = mkstemp(&temp_path[0]);
+    FILE* file = fd < 0 ? NULL : fdopen(fd, "w");
+    if (file == NULL)
+    {
+        cerr << ERROR_MSG_A << ERROR_CACHE_WRITE << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    bool written = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    if (fclose(file) || !written || rename(temp_path.c_str(), path.c_str()))
+    {
+        cerr << ERROR_MSG_A << ERROR_CACHE_WRITE << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Rebuilds a pair of a cache file and emits it, or an item and adds it to the
+ * input with Emit1. The framework deletes the rebuilt objects, also when it
+ * does not delete the k2 and v2 of Map.
+ * @param key
+ * @param key_size
+ * @param value
+ * @param value_size
+ * @param arg the job.
+ */
+void emitCachedPair(const char* key, size_t key_size, const char* value,
+                    size_t value_size, void* arg)
+{
+    JobContext* job = (JobContext*) arg;
+    if (key[0] == CACHE_ITEM_TAG)
+    {
+        k1Base* key1 = job->input_factory->DeserializeK1(key + 1,
+                                                         key_size - 1);
+        v1Base* value1 = value_size == 0 ? NULL :
+                job->input_factory->DeserializeV1(value + 1, value_size - 1);
+        Emit1(key1, value1);
+        return;
+    }
+    key++;
+    key_size--;
+    k2Base* key2 = job->intermediate_factory->DeserializeK2(key, key_size);
+    v2Base* value2 = job->intermediate_factory->DeserializeV2(value,
+                                                              value_size);
+    Emit2(key2, value2);
+    if (!job->toDealloc)
+    {
+        current_worker->k2_for_delete.push_back(key2);
+        current_worker->v2_for_delete.push_back(value2);
+    }
+}
+
+/**
+ * Adds an item that Map emitted to the cache record of the call.
+ * @param key1
+ * @param value1
+ * @param record
+ * @return false if the item can't be rebuilt later, because the job is not
+ * an InputFactory or the item is not Serializable.
+ */
+bool recordItem(k1Base* key1, v1Base* value1, string& record)
+{
+    const Serializable* key = dynamic_cast<const Serializable*>(key1);
+    const Serializable* value = dynamic_cast<const Serializable*>(value1);
+    if (current_job->input_factory == NULL || key == NULL ||
+        (value1 != NULL && value == NULL))
+    {
+        return false;
+    }
+    // A null value is recorded as no bytes at all.
+    string key_bytes(1, CACHE_ITEM_TAG);
+    string value_bytes;
+    key->Serialize(key_bytes);
+    if (value != NULL)
+    {
+        value_bytes.push_back(CACHE_VALUE_TAG);
+        value->Serialize(value_bytes);
+    }
+    appendPair(record, key_bytes, value_bytes);
+    return true;
+}
+
+// SPECULATION
+
+MapChunk::MapChunk(const IN_ITEM* items, unsigned long size,
+                   long start_nanos):
+        items(items), size(size), start_nanos(start_nanos), attempts(1),
+        running(1), done(false)
+{
+}
+
+/**
+ * Starts to track a chunk the mapper claimed, before its first run.
+ * @param job
+ * @param items first item of the chunk.
+ * @param size number of items in the chunk.
+ * @return the chunk, it lives as long as the job.
+ */
+MapChunk* registerChunk(JobContext* job, const IN_ITEM* items,
+                        unsigned long size)
+{
+    lockMutex(&job->chunks_mutex);
+    job->map_chunks.emplace_back(items, size, nowNanos());
+    MapChunk* chunk = &job->map_chunks.back();
+    unlockMutex(&job->chunks_mutex);
+    return chunk;
+}
+
+/**
+ * Runs Map on the items of a chunk, and stops between items once another run
+ * of the chunk finished. The first run to finish hands its pairs to the
+ * shuffle and its emitted items to the mappers, and the one that finishes the
+ * last chunk ends the shuffle, so the reduce does not wait for the other
+ * runs. A run that lost drops its pairs and items.
+ * @param job
+ * @param chunk with this run counted in its attempts.
+ */
+void runChunkAttempt(JobContext* job, MapChunk* chunk)
+{
+    IN_ITEMS_VEC* in_items_vec = (IN_ITEMS_VEC*) job->map_arg;
+    WorkerState* state = current_worker;
+    long start = nowNanos();
+    unsigned long i;
+    for (i = 0; i < chunk->size && !chunk->done; i++)
+    {
+        const IN_ITEM& item = chunk->items[i];
+        job->map_reduce_base->Map(item.first, item.second);
+    }
+    lockMutex(&job->chunks_mutex);
+    chunk->running--;
+    if (i == chunk->size && !chunk->done)
+    {
+        chunk->done = true;
+        job->items_committed += chunk->size;
+        job->committed_nanos += nowNanos() - start;
+        if (job->control != NULL)
+        {
+            job->control->itemsMapped.fetch_add(chunk->size,
+                                                memory_order_relaxed);
+            job->control->pairsEmitted.fetch_add(state->attempt_pairs.size(),
+                                                 memory_order_relaxed);
+        }
+        // Under the chunks mutex, so the pairs of every chunk are in the
+        // containers before the shuffle takes them for the last time, and
+        // the items are counted before the last chunk is known.
+        handOverPairs(state->attempt_pairs);
+        for (const IN_ITEM& item : state->attempt_items)
+        {
+            addItem(job, item);
+        }
+        state->attempt_items.clear();
+        if (job->items_committed ==
+            in_items_vec->size() + job->emitted_items.size())
+        {
+            endMapPhase(job);
+        }
+        // The mappers in speculate look at the chunks again.
+        if (pthread_cond_broadcast(&job->chunks_cond))
+        {
+            cerr << ERROR_MSG_A << ERROR_SIGNAL_COND << ERROR_MSG_B << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    unlockMutex(&job->chunks_mutex);
+    for (const IN_ITEM& item : state->attempt_items)
+    {
+        delete item.first;
+        delete item.second;
+    }
+    state->attempt_items.clear();
+    // Jobs are speculative only when the framework deletes k2 and v2.
+    for (MAP_OUTPUT_TYPE& pair : state->attempt_pairs)
+    {
+        if (!state->arena.owns(pair.first))
+        {
+            delete pair.first;
+        }
+        if (!state->arena.owns(pair.second))
+        {
+            delete pair.second;
+        }
+    }
+    state->attempt_pairs.clear();
+}
+
+/**
+ * Finds the chunk that runs for the longest time, out of the chunks that run
+ * much longer than the chunks that finished took for the same number of
+ * items. Called with the chunks mutex held.
+ * @param job
+ * @param waiting set to true if a chunk did not finish, so it may still be
+ * run again or emit items.
+ * @param wake_nanos set to the time the next chunk turns slow enough, at most
+ * SPECULATION_MIN_NANOS from now, since chunks that start later take at least
+ * that long to.
+ * @return the chunk, or null if no chunk is slow enough.
+ */
+MapChunk* findStraggler(JobContext* job, bool* waiting, long* wake_nanos)
+{
+    long now = nowNanos();
+    long item_nanos = job->items_committed > 0 ?
+                      job->committed_nanos / (long) job->items_committed : 0;
+    MapChunk* straggler = NULL;
+    *waiting = false;
+    *wake_nanos = now + SPECULATION_MIN_NANOS;
+    for (MapChunk& chunk : job->map_chunks)
+    {
+        if (chunk.done)
+        {
+            continue;
+        }
+        *waiting = true;
+        if (chunk.attempts >= SPECULATION_MAX_ATTEMPTS)
+        {
+            continue;
+        }
+        long expected = SPECULATION_FACTOR * item_nanos * (long) chunk.size;
+        long slow_nanos = chunk.start_nanos + max(expected,
+                                                  SPECULATION_MIN_NANOS);
+        if (now > slow_nanos)
+        {
+            if (straggler == NULL ||
+                chunk.start_nanos < straggler->start_nanos)
+            {
+                straggler = &chunk;
+            }
+        }
+        else
+        {
+            *wake_nanos = min(*wake_nanos, slow_nanos);
+        }
+    }
+    return straggler;
+}
+
+/**
+ * Sleeps until a chunk finishes, the job is cancelled or the given time.
+ * Called with the chunks mutex held.
+ * @param job
+ * @param wake_nanos a time of nowNanos.
+ */
+void waitForChunks(JobContext* job, long wake_nanos)
+{
+    struct timespec deadline;
+    deadline.tv_sec = wake_nanos / SEC_TO_NANOSEC;
+    deadline.tv_nsec = wake_nanos % SEC_TO_NANOSEC;
+    int result = pthread_cond_timedwait(&job->chunks_cond, &job->chunks_mutex,
+                                        &deadline);
+    if (result != 0 && result != ETIMEDOUT)
+    {
+        cerr << ERROR_MSG_A << ERROR_WAIT_COND << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Keeps a mapper that has no chunks left to claim busy with the items that
+ * Map emitted, each a chunk of its own, and with running the slow chunks of
+ * the others again, until every chunk finished.
+ * @param job
+ */
+void speculate(JobContext* job)
+{
+    while (job->control == NULL || !job->control->IsCancelled())
+    {
+        bool waiting = true;
+        long wake_nanos = 0;
+        MapChunk* straggler = NULL;
+        // Under the chunks mutex, so no chunk finishes and emits items after
+        // there were none to claim and before the mapper sleeps.
+        lockMutex(&job->chunks_mutex);
+        const IN_ITEM* item = claimEmittedItem(job);
+        if (item == NULL)
+        {
+            straggler = findStraggler(job, &waiting, &wake_nanos);
+        }
+        if (straggler != NULL)
+        {
+            straggler->attempts++;
+            straggler->running++;
+        }
+        else if (item == NULL && waiting &&
+                 (job->control == NULL || !job->control->IsCancelled()))
+        {
+            waitForChunks(job, wake_nanos);
+            unlockMutex(&job->chunks_mutex);
+            continue;
+        }
+        unlockMutex(&job->chunks_mutex);
+        if (item != NULL)
+        {
+            long wall_start = nowNanos();
+            long cpu_start = threadCpuNanos();
+            runChunkAttempt(job, registerChunk(job, item, 1));
+            observeMapper(job, wall_start, cpu_start);
+        }
+        else if (straggler != NULL)
+        {
+            runChunkAttempt(job, straggler);
+        }
+        else
+        {
+            return;
+        }
+    }
+}
+
+/**
+ * @param job
+ * @return the number of runs of chunks that are still in a Map call, after
+ * the shuffle ended.
+ */
+int runningAttempts(JobContext* job)
+{
+    int running = 0;
+    lockMutex(&job->chunks_mutex);
+    for (MapChunk& chunk : job->map_chunks)
+    {
+        running += chunk.running;
+    }
+    unlockMutex(&job->chunks_mutex);
+    return running;
+}
+
+// HASH SHUFFLE
+
+KeyTable::KeyTable(vector<SHUFFLE_ITEM>& groups): groups(groups)
+{
+}
+
+vector<v2Base*>& KeyTable::find(k2Base* key, const HashableKey* hashable)
+{
+    if (groups.size() * 2 >= slots.size())
+    {
+        grow();
+    }
+    // Spreads weak hashes, such as the value of an int key, over the table.
+    size_t hash = hashable->Hash() * HASH_MULTIPLIER;
+    size_t mask = slots.size() - 1;
+    for (size_t i = (hash >> 32) & mask; ; i = (i + 1) & mask)
+    {
+        Slot& slot = slots[i];
+        if (slot.group == 0)
+        {
+            groups.push_back(SHUFFLE_ITEM(key, vector<v2Base*>()));
+            slot.hash = hash;
+            slot.group = groups.size();
+            return groups.back().second;
+        }
+        if (slot.hash == hash && *hashable == *groups[slot.group - 1].first)
+        {
+            return groups[slot.group - 1].second;
+        }
+    }
+}
+
+void KeyTable::grow()
+{
+    vector<Slot> old_slots;
+    old_slots.swap(slots);
+    slots.assign(max(old_slots.size() * 2, (size_t) KEY_TABLE_MIN_SLOTS),
+                 Slot());
+    size_t mask = slots.size() - 1;
+    for (Slot& slot : old_slots)
+    {
+        if (slot.group != 0)
+        {
+            size_t i = (slot.hash >> 32) & mask;
+            while (slots[i].group != 0)
+            {
+                i = (i + 1) & mask;
+            }
+            slots[i] = slot;
+        }
+    }
+}
+
+/**
+ * Finds the HashableKey part of a key of a job that groups in the hash table.
+ * Keys of the class of the first key are adjusted by the offset found for
+ * it, others go through dynamic_cast, if a key is not a HashableKey prints
+ * an error and exit.
+ * @param job
+ * @param key
+ * @return the key, as a HashableKey.
+ */
+const HashableKey* hashableKey(JobContext* job, const k2Base* key)
+{
+    if (&typeid(*key) == job->key_type)
+    {
+        return (const HashableKey*) ((const char*) key + job->hashable_offset);
+    }
+    const HashableKey* hashable = dynamic_cast<const HashableKey*>(key);
+    if (hashable == NULL)
+    {
+        cerr << ERROR_MSG_A << ERROR_MIXED_KEYS << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    return hashable;
+}
+
+/**
+ * Adds a pair to the group of its key. The first pair of the job decides
+ * how the keys are grouped: in the hash table when they are HashableKey and
+ * the job does not spill, since the spilled runs are merged in key order,
+ * and in shuffle_output otherwise. The keys of a job that groups in the hash
+ * table must all be HashableKey.
+ * @param job
+ * @param pair
+ */
+void groupPair(JobContext* job, const MAP_OUTPUT_TYPE& pair)
+{
+    if (!job->keys_checked)
+    {
+        job->keys_checked = true;
+        const HashableKey* hashable =
+                dynamic_cast<const HashableKey*>(pair.first);
+        job->hash_keys = hashable != NULL && job->memory_budget == 0;
+        if (job->hash_keys)
+        {
+            job->key_type = &typeid(*pair.first);
+            job->hashable_offset = (const char*) hashable -
+                                   (const char*) pair.first;
+        }
+    }
+    if (job->hash_keys)
+    {
+        job->key_table.find(pair.first, hashableKey(job, pair.first))
+                .push_back(pair.second);
+        return;
+    }
+    job->shuffle_output[pair.first].push_back(pair.second);
+}
+
+ /**
+ * The function that the shuffle thread runs, gets their pairs, shuffles them and creates to each key the list with the
+  * values.
+ * @param job
+  * @return
+  */
+int shuffleCycle(JobContext* job)
+{
+    lockMutex(&job->states_mutex);
+    for (map<pthread_t, WorkerState*, compareThreads>::iterator it =
+            job->worker_states.begin(); it != job->worker_states.end(); ++it)
+    {
+        WorkerState* state = it->second;
+        // The batches are taken out at once, so the mapper does not wait
+        // for them to be grouped.
+        MAP_OUTPUT_LIST batches;
+        lockMutex(&state->container_mutex);
+        batches.swap(state->container);
+        unlockMutex(&state->container_mutex);
+        for (MAP_OUTPUT_TYPE& cur_pair : batches)
+        {
+            groupPair(job, cur_pair);
+        }
+        if (job->control != NULL)
+        {
+            job->control->pairsShuffled.fetch_add(batches.size(),
+                                                  memory_order_relaxed);
+        }
+    }
+    unlockMutex(&job->states_mutex);
+    return 0;
+}
+
+/**
+ * While execmap threads exists calss to the shuffle function, and one more time
+ * again at the end. Then crestes a vector
+ * wuth the items.
+ * @param ptr the job.
+ * @return null if everythhing's ok.
+ */
+void* shuffleWork(void* ptr)
+{
+    JobContext* job = (JobContext*) ptr;
+    lockMutex(&job->shuffle_mutex);
+    while (true)
+    {
+        while (job->ready_batches == 0 && job->exec_map_exists)
+        {
+            if (pthread_cond_wait(&job->shuffle_cond, &job->shuffle_mutex))
+            {
+                cerr << ERROR_MSG_A << ERROR_WAIT_COND << ERROR_MSG_B << endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (!job->exec_map_exists)
+        {
+            break;
+        }
+        // One cycle takes every batch that is ready by now.
+        job->ready_batches = 0;
+        unlockMutex(&job->shuffle_mutex);
+        shuffleCycle(job);
+        lockMutex(&job->shuffle_mutex);
+    }
+    unlockMutex(&job->shuffle_mutex);
+    shuffleCycle(job);
+    for (SHUFFLE_LIST::iterator it = job->shuffle_output.begin();
+         it != job->shuffle_output.end(); ++it)
+    {
+        job->shuffle_vec.push_back(*it);
+    }
+    writecontentToFile(TERMINATE_THREAD_MSG, SHUFFLE_NAME, NULL, NULL, 1);
+    return NULL;
+}
+
+/**
+ * The reduce function that the execReduce threads runs.
+ * @param ptr the job.
+ * @return null if everithng's ok.
+ */
+void* execReduce(void* ptr)
+{
+    JobContext* job = (JobContext*) ptr;
+    job->enter();
+    writecontentToFile(CREATE_THREAD_MSG, EXEC_REDUCE_NAME, NULL, NULL, 1);
+    OUT_ITEMS_VEC& output = current_worker->reduce_output;
+    size_t sorted_size = output.size();
+    unsigned long begin;
+    unsigned long end;
+    while (claimChunk(&job->index_for_reduce, job->shuffle_vec.size(), &begin,
+                      &end))
+    {
+        for (unsigned long i = begin; i < end; i++)
+        {
+            SHUFFLE_ITEM& cur_pair = job->shuffle_vec[i];
+            job->map_reduce_base->Reduce(cur_pair.first, cur_pair.second);
+        }
+        if (job->control != NULL)
+        {
+            job->control->keysReduced.fetch_add(end - begin,
+                                                memory_order_relaxed);
+        }
+    }
+    if (job->sort_output && job->limit == 0 && output.size() > sorted_size)
+    {
+        // Every batch leaves a sorted run, the job merges all of them once.
+        sort(output.begin() + sorted_size, output.end(), outputComperator);
+        current_worker->output_runs.push_back(sorted_size);
+    }
+    writecontentToFile(TERMINATE_THREAD_MSG, EXEC_REDUCE_NAME, NULL, NULL, 1);
+    return NULL;
+}
+
+/**
+ * Folds the parts of the hot keys that the execCombine task claims.
+ * @param ptr the job.
+ * @return null if everithng's ok.
+ */
+void* execCombine(void* ptr)
+{
+    JobContext* job = (JobContext*) ptr;
+    job->enter();
+    unsigned long begin;
+    unsigned long end;
+    while (claimChunk(&job->index_for_combine, job->combine_parts.size(),
+                      &begin, &end))
+    {
+        for (unsigned long i = begin; i < end; i++)
+        {
+            CombinePart& part = job->combine_parts[i];
+            SHUFFLE_ITEM& group = job->shuffle_vec[part.group];
+            V2_VEC values(group.second.begin() + part.begin,
+                          group.second.begin() + part.end);
+            part.result = job->associative_reducer->Combine(group.first, values);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Splits the keys that hold too many of the values for one reducer into parts
+ * that all the workers fold, and leaves each of those keys with only the
+ * folded parts. The parts are deleted with the other k2, v2.
+ * @param job
+ * @param phase_group
+ */
+void splitHotKeys(JobContext* job, TaskGroup* phase_group)
+{
+    unsigned long total = 0;
+    for (SHUFFLE_ITEM& group : job->shuffle_vec)
+    {
+        total += group.second.size();
+    }
+    unsigned long limit = max((unsigned long) HOT_KEY_MIN_VALUES,
+                              total / (job->phase_threads * HOT_KEY_FACTOR));
+    job->combine_parts.clear();
+    for (unsigned long i = 0; i < job->shuffle_vec.size(); i++)
+    {
+        unsigned long size = job->shuffle_vec[i].second.size();
+        if (size <= limit)
+        {
+            continue;
+        }
+        unsigned long part_size = max((unsigned long) HOT_KEY_MIN_VALUES,
+                                      (size + job->phase_threads - 1) /
+                                      job->phase_threads);
+        for (unsigned long begin = 0; begin < size; begin += part_size)
+        {
+            CombinePart part;
+            part.group = i;
+            part.begin = begin;
+            part.end = min(begin + part_size, size);
+            part.result = NULL;
+            job->combine_parts.push_back(part);
+        }
+    }
+    if (job->combine_parts.empty())
+    {
+        return;
+    }
+    job->index_for_combine = 0;
+    for (int i = 0; i < job->phase_threads; i++)
+    {
+        framework_context->submit(execCombine, job, phase_group);
+    }
+    framework_context->wait(phase_group);
+    unsigned long group = job->shuffle_vec.size();
+    for (CombinePart& part : job->combine_parts)
+    {
+        if (part.group != group)
+        {
+            group = part.group;
+            job->shuffle_vec[group].second.clear();
+        }
+        job->shuffle_vec[group].second.push_back(part.result);
+    }
+}
+
+/**
+ * Creates the framework on the first job and grows its pool, so that every
+ * job that runs at the same time has a worker for each of its threads.
+ * @param multiThreadLevel the pool threads the new job needs.
+ */
+void beginJob(int multiThreadLevel)
+{
+    lockMutex(&context_mutex);
+    if (framework_context == NULL)
+    {
+        framework_context = new FrameworkContext();
+    }
+    framework_context->active_levels += multiThreadLevel;
+    framework_context->ensureWorkers(framework_context->active_levels);
+    unlockMutex(&context_mutex);
+}
+
+/**
+ * Gives back the pool threads of a job that finished and publishes its times,
+ * and how much its mappers were blocked for the next job of the class.
+ * @param job
+ * @param multiThreadLevel as given to beginJob.
+ */
+void endJob(JobContext* job, int multiThreadLevel)
+{
+    lockMutex(&context_mutex);
+    framework_context->active_levels -= multiThreadLevel + job->added_levels;
+    last_job_stats = job->stats;
+    if (job->map_wall_nanos > 0)
+    {
+        blocked_fractions[typeid(*job->map_reduce_base).name()] =
+                max(1.0 - (double) job->map_cpu_nanos / job->map_wall_nanos,
+                    0.0);
+    }
+    unlockMutex(&context_mutex);
+    current_job = NULL;
+    current_worker = NULL;
+}
+
+/**
+ * This function called at the end of the prigramm, flushes the log. The rest
+ * of the job goes with its context.
+ */
+void cleanResources()
+{
+    framework_context->logger->flush();
+}
+
+/**
+ * Deletes k2, v2 according to the bollean flag that gave by the user, the
+ * ones that came from the arenas, the folded parts of hot keys and the items
+ * that Map emitted are always released.
+ * @param job
+ */
+void deallocK2V2(JobContext* job)
+{
+    for (IN_ITEM& item : job->emitted_items)
+    {
+        delete item.first;
+        delete item.second;
+    }
+    job->emitted_items.clear();
+    for (CombinePart& part : job->combine_parts)
+    {
+        delete part.result;
+    }
+    job->combine_parts.clear();
+    for (map<pthread_t, WorkerState*, compareThreads>::iterator it =
+            job->worker_states.begin(); it != job->worker_states.end(); ++it)
+    {
+        WorkerState* state = it->second;
+        for (k2Base* k2 : state->k2_for_delete)
+        {
+            delete (k2);
+        }
+        for (v2Base* v2 : state->v2_for_delete)
+        {
+            delete (v2);
+        }
+        state->k2_for_delete.clear();
+        state->v2_for_delete.clear();
+        state->arena.release();
+    }
+}
+
+// EXTERNAL SHUFFLE
+
+/**
+ * Serializes a k2 or v2 object, if it is not Serializable prints an error and
+ * exit.
+ * @param object
+ * @param is_key
+ * @param out
+ */
+void serializeOrFail(const void* object, bool is_key, string& out)
+{
+    const Serializable* serializable = is_key ?
+            dynamic_cast<const Serializable*>((const k2Base*) object) :
+            dynamic_cast<const Serializable*>((const v2Base*) object);
+    if (serializable == NULL)
+    {
+        cerr << ERROR_MSG_A << ERROR_SERIALIZABLE << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    serializable->Serialize(out);
+}
+
+/**
+ * Writes the length of the bytes and then the bytes, if they are 4 GiB or
+ * more prints an error and exit.
+ * @param file
+ * @param bytes
+ */
+void writeBytes(FILE* file, const string& bytes)
+{
+    if (bytes.size() > UINT32_MAX)
+    {
+        cerr << ERROR_MSG_A << ERROR_PAIR_SIZE << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    uint32_t size = bytes.size();
+    if (fwrite(&size, sizeof(size), 1, file) != 1 ||
+        fwrite(bytes.data(), 1, size, file) != size)
+    {
+        cerr << ERROR_MSG_A << ERROR_SPILL_WRITE << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Reads what writeBytes wrote.
+ * @param file
+ * @param bytes
+ * @return false at the end of the file.
+ */
+bool readBytes(FILE* file, string& bytes)
+{
+    uint32_t size;
+    if (fread(&size, sizeof(size), 1, file) != 1)
+    {
+        return false;
+    }
+    bytes.resize(size);
+    if (size > 0 && fread(&bytes[0], 1, size, file) != size)
+    {
+        cerr << ERROR_MSG_A << ERROR_SPILL_READ << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    return true;
+}
+
+/**
+ * Keeps a pair in the buffer of the calling mapper. The size of a pair is
+ * estimated from the first one the mapper emits, and corrected by every spill.
+ * @param key2
+ * @param value2
+ */
+void bufferForSpill(k2Base* key2, v2Base* value2)
+{
+    WorkerState* state = current_worker;
+    if (state->pair_bytes == 0)
+    {
+        string bytes;
+        serializeOrFail(key2, true, bytes);
+        serializeOrFail(value2, false, bytes);
+        state->pair_bytes = PAIR_OVERHEAD_BYTES + bytes.size();
+    }
+    state->pair_buffer.push_back(MAP_OUTPUT_TYPE(key2, value2));
+    state->spill_bytes += state->pair_bytes;
+}
+
+/**
+ * Sorts the buffer of the calling mapper and writes it as a run of groups,
+ * each one is the key and then the count and the values. The pairs are
+ * released right after.
+ */
+void spillBuffer()
+{
+    WorkerState* state = current_worker;
+    if (state->pair_buffer.empty())
+    {
+        return;
+    }
+    if (current_job->control != NULL)
+    {
+        // The spilled pairs skip the shuffle.
+        current_job->control->pairsShuffled.fetch_add(
+                state->pair_buffer.size(), memory_order_relaxed);
+    }
+    classcomp comp;
+    sort(state->pair_buffer.begin(), state->pair_buffer.end(),
+         [&comp](const MAP_OUTPUT_TYPE& first, const MAP_OUTPUT_TYPE& second)
+         { return comp(first.first, second.first); });
+    string path = string(current_job->spill_directory) + SPILL_FILE_TEMPLATE;
+    int fd = mkstemp(&path[0]);
+    FILE* run = fd < 0 ? NULL : fdopen(fd, "w+");
+    if (run == NULL)
+    {
+        cerr << ERROR_MSG_A << ERROR_SPILL_CREATE << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    unlink(path.c_str());
+    size_t written = 0;
+    string bytes;
+    vector<MAP_OUTPUT_TYPE>& buffer = state->pair_buffer;
+    for (size_t begin = 0; begin < buffer.size();)
+    {
+        size_t end = begin + 1;
+        while (end < buffer.size() && !comp(buffer[begin].first, buffer[end].first))
+        {
+            end++;
+        }
+        bytes.clear();
+        serializeOrFail(buffer[begin].first, true, bytes);
+        writeBytes(run, bytes);
+        uint32_t count = end - begin;
+        if (fwrite(&count, sizeof(count), 1, run) != 1)
+        {
+            cerr << ERROR_MSG_A << ERROR_SPILL_WRITE << ERROR_MSG_B << endl;
+            exit(EXIT_FAILURE);
+        }
+        written += bytes.size();
+        for (size_t i = begin; i < end; i++)
+        {
+            bytes.clear();
+            serializeOrFail(buffer[i].second, false, bytes);
+            writeBytes(run, bytes);
+            written += bytes.size();
+        }
+        begin = end;
+    }
+    if (fflush(run))
+    {
+        cerr << ERROR_MSG_A << ERROR_SPILL_WRITE << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    state->pair_bytes = PAIR_OVERHEAD_BYTES + written / buffer.size();
+    if (current_job->toDealloc)
+    {
+        for (MAP_OUTPUT_TYPE& pair : buffer)
+        {
+            if (!state->arena.owns(pair.first))
+            {
+                delete pair.first;
+            }
+            if (pair.second != NULL && !state->arena.owns(pair.second))
+            {
+                delete pair.second;
+            }
+        }
+    }
+    // Arena objects may be released only if none of them went to the shuffle.
+    if (!state->handed_to_shuffle)
+    {
+        state->arena.release();
+    }
+    buffer.clear();
+    state->spill_bytes = 0;
+    state->spilled = true;
+    lockMutex(&current_job->spill_mutex);
+    current_job->spill_runs.push_back(run);
+    unlockMutex(&current_job->spill_mutex);
+}
+
+/**
+ * Hands the pairs the mapper keeps to the shuffle as one batch, when there are
+ * enough of them and at the end of a map task. At the end of a map task, a
+ * mapper that spilled spills what is left too.
+ */
+void handOverBuffer()
+{
+    WorkerState* state = current_worker;
+    if (state->spilled)
+    {
+        spillBuffer();
+        return;
+    }
+    if (state->pair_buffer.empty())
+    {
+        return;
+    }
+    handOverPairs(state->pair_buffer);
+    state->spill_bytes = 0;
+    state->handed_to_shuffle = true;
+}
+
+/**
+ * Moves pairs the mapper kept aside to its container, where the shuffle takes
+ * them from.
+ * @param pairs emptied.
+ */
+void handOverPairs(vector<MAP_OUTPUT_TYPE>& pairs)
+{
+    WorkerState* state = current_worker;
+    if (current_job->toDealloc)
+    {
+        for (MAP_OUTPUT_TYPE& pair : pairs)
+        {
+            if (!state->arena.owns(pair.first))
+            {
+                state->k2_for_delete.push_back(pair.first);
+            }
+            if (pair.second != NULL && !state->arena.owns(pair.second))
+            {
+                state->v2_for_delete.push_back(pair.second);
+            }
+        }
+    }
+    lockMutex(&state->container_mutex);
+    state->container.insert(state->container.end(), pairs.begin(),
+                            pairs.end());
+    unlockMutex(&state->container_mutex);
+    signalShuffle(current_job);
+    pairs.clear();
+}
+
+RunReader::RunReader(FILE* file): key(NULL), bytes(0), file(file)
+{
+    rewind(file);
+}
+
+RunReader::~RunReader()
+{
+    fclose(file);
+}
+
+bool RunReader::next()
+{
+    if (!readBytes(file, buffer))
+    {
+        return false;
+    }
+    key = current_job->intermediate_factory->DeserializeK2(buffer.data(),
+                                                           buffer.size());
+    bytes = PAIR_OVERHEAD_BYTES + buffer.size();
+    uint32_t count;
+    if (fread(&count, sizeof(count), 1, file) != 1)
+    {
+        cerr << ERROR_MSG_A << ERROR_SPILL_READ << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    values.clear();
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (!readBytes(file, buffer))
+        {
+            cerr << ERROR_MSG_A << ERROR_SPILL_READ << ERROR_MSG_B << endl;
+            exit(EXIT_FAILURE);
+        }
+        values.push_back(current_job->intermediate_factory->DeserializeV2(
+                buffer.data(), buffer.size()));
+        bytes += PAIR_OVERHEAD_BYTES + buffer.size();
+    }
+    return true;
+}
+
+bool RunMerger::SourceComp::operator()(int first, int second) const
+{
+    // priority_queue keeps the largest on top, so the order is reversed.
+    return *merger->currentKey(second) < *merger->currentKey(first);
+}
+
+RunMerger::RunMerger(const vector<FILE*>& runs, SHUFFLE_LIST& in_memory):
+        memory_it(in_memory.begin()), memory_end(in_memory.end()),
+        heap(SourceComp{this})
+{
+    for (FILE* run : runs)
+    {
+        readers.push_back(new RunReader(run));
+    }
+    for (int source = 0; source <= (int) readers.size(); source++)
+    {
+        if (source < (int) readers.size() && !readers[source]->next())
+        {
+            continue;
+        }
+        if (source == (int) readers.size() && memory_it == memory_end)
+        {
+            continue;
+        }
+        heap.push(source);
+    }
+}
+
+RunMerger::~RunMerger()
+{
+    for (RunReader* reader : readers)
+    {
+        delete reader;
+    }
+}
+
+k2Base* RunMerger::currentKey(int source) const
+{
+    if (source == (int) readers.size())
+    {
+        return memory_it->first;
+    }
+    return readers[source]->key;
+}
+
+void RunMerger::advance(int source)
+{
+    if (source == (int) readers.size())
+    {
+        if (++memory_it != memory_end)
+        {
+            heap.push(source);
+        }
+    }
+    else if (readers[source]->next())
+    {
+        heap.push(source);
+    }
+}
+
+bool RunMerger::next(SHUFFLE_ITEM* group, size_t* bytes)
+{
+    if (heap.empty())
+    {
+        return false;
+    }
+    group->first = NULL;
+    group->second.clear();
+    *bytes = 0;
+    do
+    {
+        int source = heap.top();
+        heap.pop();
+        k2Base* key = currentKey(source);
+        if (source == (int) readers.size())
+        {
+            vector<v2Base*>& values = memory_it->second;
+            group->second.insert(group->second.end(), values.begin(),
+                                 values.end());
+            *bytes += PAIR_OVERHEAD_BYTES * (values.size() + 1);
+        }
+        else
+        {
+            // Rebuilt objects belong to the framework.
+            RunReader* reader = readers[source];
+            group->second.insert(group->second.end(), reader->values.begin(),
+                                 reader->values.end());
+            *bytes += reader->bytes;
+            current_worker->v2_for_delete.insert(
+                    current_worker->v2_for_delete.end(),
+                    reader->values.begin(), reader->values.end());
+            current_worker->k2_for_delete.push_back(key);
+        }
+        if (group->first == NULL)
+        {
+            group->first = key;
+        }
+        advance(source);
+    }
+    while (!heap.empty() && !(*group->first < *currentKey(heap.top())));
+    return true;
+}
+
+/**
+ * The reduce phase of a job that spilled: the merged groups are reduced in
+ * batches that fit the memory budget, and each batch is released before the
+ * next one is read.
+ * @param job
+ * @param phase_group
+ */
+void reduceSpilledRuns(JobContext* job, TaskGroup* phase_group)
+{
+    // The calling thread rebuilds objects, it keeps them in its own state.
+    WorkerState merge_state;
+    current_worker = &merge_state;
+    RunMerger merger(job->spill_runs, job->shuffle_output);
+    job->spill_runs.clear();
+    SHUFFLE_ITEM group;
+    size_t group_bytes;
+    bool more = true;
+    while (more && (job->control == NULL || !job->control->IsCancelled()))
+    {
+        size_t batch_bytes = 0;
+        job->shuffle_vec.clear();
+        while (batch_bytes < job->memory_budget &&
+               (more = merger.next(&group, &group_bytes)))
+        {
+            job->shuffle_vec.push_back(group);
+            batch_bytes += group_bytes;
+        }
+        if (job->control != NULL)
+        {
+            job->control->keysTotal.fetch_add(job->shuffle_vec.size());
+        }
+        job->index_for_reduce = 0;
+        for (int i = 0; i < job->phase_threads; i++)
+        {
+            framework_context->submit(execReduce, job, phase_group);
+        }
+        framework_context->wait(phase_group);
+        for (k2Base* k2 : merge_state.k2_for_delete)
+        {
+            delete k2;
+        }
+        for (v2Base* v2 : merge_state.v2_for_delete)
+        {
+            delete v2;
+        }
+        merge_state.k2_for_delete.clear();
+        merge_state.v2_for_delete.clear();
+    }
+    current_worker = NULL;
+}
+
+// OUTPUT MERGE
+
+/**
+ * Merges the part of every sorted run that falls in the range of the task
+ * into its place in the output, or into the sink.
+ * @param arg the OutputMerge.
+ * @param task
+ */
+void mergeOutputRange(void* arg, int task)
+{
+    OutputMerge* merge = (OutputMerge*) arg;
+    vector<size_t> next = merge->bounds[task];
+    const vector<size_t>& ends = merge->bounds[task + 1];
+    // A heap of the runs that have items left, by their next key.
+    auto after = [merge, &next](int first, int second)
+    {
+        return outputComperator((*merge->runs[second])[next[second]],
+                                (*merge->runs[first])[next[first]]);
+    };
+    priority_queue<int, vector<int>, decltype(after)> heap(after);
+    for (size_t run = 0; run < merge->runs.size(); run++)
+    {
+        if (next[run] < ends[run])
+        {
+            heap.push(run);
+        }
+    }
+    OUT_ITEMS_VEC::iterator out = merge->output->begin() +
+                                  merge->offsets[task];
+    while (!heap.empty())
+    {
+        int run = heap.top();
+        heap.pop();
+        OUT_ITEM& item = (*merge->runs[run])[next[run]++];
+        if (merge->sink != NULL)
+        {
+            merge->sink->Write(item.first, item.second);
+        }
+        else
+        {
+            *out++ = item;
+        }
+        if (next[run] < ends[run])
+        {
+            heap.push(run);
+        }
+    }
+}
+
+/**
+ * Merges the sorted runs of the reducers into the output of the job. The
+ * keys are split into ranges by a sample of every run, and the ranges are
+ * merged at the same time on the workers. When the job does not sort its
+ * output they are only put one after the other. A sink gets the sorted pairs
+ * from one merge of all the outputs, by the calling thread, and when the job
+ * does not sort its output it already got them all from Emit3.
+ * @param job
+ * @param output
+ */
+void mergeOutputs(JobContext* job, OUT_ITEMS_VEC& output)
+{
+    OutputMerge merge;
+    merge.sink = job->output_sink;
+    size_t total = 0;
+    for (map<pthread_t, WorkerState*, compareThreads>::iterator it =
+            job->worker_states.begin(); it != job->worker_states.end(); ++it)
+    {
+        if (!it->second->reduce_output.empty())
+        {
+            merge.runs.push_back(&it->second->reduce_output);
+            total += it->second->reduce_output.size();
+        }
+    }
+    if (job->limit > 0)
+    {
+        mergeLimited(job, merge.runs, output);
+        return;
+    }
+    if (!job->sort_output)
+    {
+        if (merge.sink != NULL)
+        {
+            return;
+        }
+        output.reserve(total);
+        for (OUT_ITEMS_VEC* run : merge.runs)
+        {
+            output.insert(output.end(), run->begin(), run->end());
+        }
+        return;
+    }
+    // A worker that reduced several batches has a sorted run for each one.
+    merge.runs.clear();
+    vector<size_t> starts;
+    vector<size_t> ends;
+    for (map<pthread_t, WorkerState*, compareThreads>::iterator it =
+            job->worker_states.begin(); it != job->worker_states.end(); ++it)
+    {
+        WorkerState* state = it->second;
+        for (size_t i = 0; i < state->output_runs.size(); i++)
+        {
+            merge.runs.push_back(&state->reduce_output);
+            starts.push_back(state->output_runs[i]);
+            ends.push_back(i + 1 < state->output_runs.size() ?
+                           state->output_runs[i + 1] :
+                           state->reduce_output.size());
+        }
+    }
+    int tasks = merge.sink != NULL ? 1 :
+            (int) max(min((size_t) job->phase_threads,
+                          total / MERGE_MIN_RANGE), (size_t) 1);
+    OUT_ITEMS_VEC samples;
+    for (size_t run = 0; run < merge.runs.size(); run++)
+    {
+        for (int i = 0; i < tasks * MERGE_SAMPLES_PER_TASK; i++)
+        {
+            samples.push_back((*merge.runs[run])[starts[run] +
+                    (ends[run] - starts[run]) * i /
+                    (tasks * MERGE_SAMPLES_PER_TASK)]);
+        }
+    }
+    sort(samples.begin(), samples.end(), outputComperator);
+    merge.bounds.assign(tasks + 1, starts);
+    merge.offsets.assign(tasks + 1, 0);
+    for (int task = 1; task <= tasks; task++)
+    {
+        for (size_t run = 0; run < merge.runs.size(); run++)
+        {
+            OUT_ITEMS_VEC* items = merge.runs[run];
+            merge.bounds[task][run] = task == tasks ? ends[run] :
+                    lower_bound(items->begin() + starts[run],
+                                items->begin() + ends[run],
+                                samples[samples.size() * task / tasks],
+                                outputComperator) - items->begin();
+            merge.offsets[task] += merge.bounds[task][run] - starts[run];
+        }
+    }
+    if (merge.sink == NULL)
+    {
+        output.resize(total);
+    }
+    merge.output = &output;
+    if (tasks == 1)
+    {
+        mergeOutputRange(&merge, 0);
+        return;
+    }
+    RunOnWorkers(tasks, mergeOutputRange, &merge);
+}
+
+// LIMIT
+
+/**
+ * Orders the output pairs of a limited job, the ones it keeps first.
+ * @param largest whether the job keeps the largest keys.
+ * @param first_item
+ * @param second_item
+ * @return true if first_item is kept before second_item.
+ */
+bool limitComperator(bool largest, const OUT_ITEM& first_item,
+                     const OUT_ITEM& second_item)
+{
+    return largest ? outputComperator(second_item, first_item) :
+           outputComperator(first_item, second_item);
+}
+
+/**
+ * Adds a pair that Reduce emitted to the output of the worker, which is kept
+ * as a heap of at most limit pairs with the first one to drop on top. A pair
+ * that does not make it is deleted.
+ * @param item
+ */
+void keepInLimit(const OUT_ITEM& item)
+{
+    bool largest = current_job->limit_largest;
+    auto kept_before = [largest](const OUT_ITEM& first, const OUT_ITEM& second)
+    {
+        return limitComperator(largest, first, second);
+    };
+    OUT_ITEMS_VEC& heap = current_worker->reduce_output;
+    if (heap.size() == current_job->limit && !kept_before(item, heap.front()))
+    {
+        delete item.first;
+        delete item.second;
+        return;
+    }
+    heap.push_back(item);
+    push_heap(heap.begin(), heap.end(), kept_before);
+    if (heap.size() > current_job->limit)
+    {
+        pop_heap(heap.begin(), heap.end(), kept_before);
+        delete heap.back().first;
+        delete heap.back().second;
+        heap.pop_back();
+    }
+}
+
+/**
+ * Leaves in the reduce phase only the groups of the limit smallest or
+ * largest keys, for jobs whose Reduce keeps the key order.
+ * @param job
+ */
+void skipGroupsOverLimit(JobContext* job)
+{
+    if (job->shuffle_vec.size() <= job->limit)
+    {
+        return;
+    }
+    bool largest = job->limit_largest;
+    partial_sort(job->shuffle_vec.begin(),
+                 job->shuffle_vec.begin() + job->limit, job->shuffle_vec.end(),
+                 [largest](const SHUFFLE_ITEM& first, const SHUFFLE_ITEM& second)
+                 {
+                     return largest ? *second.first < *first.first :
+                            *first.first < *second.first;
+                 });
+    // The skipped values are released with the rest at the end of the job.
+    job->shuffle_vec.resize(job->limit);
+}
+
+/**
+ * Merges the outputs of the reducers of a limited job and stops after limit
+ * pairs, the pairs that were not taken are deleted.
+ * @param job
+ * @param runs the outputs of the reducers, at most limit pairs each.
+ * @param output
+ */
+void mergeLimited(JobContext* job, vector<OUT_ITEMS_VEC*>& runs,
+                  OUT_ITEMS_VEC& output)
+{
+    bool largest = job->limit_largest;
+    auto kept_before = [largest](const OUT_ITEM& first, const OUT_ITEM& second)
+    {
+        return limitComperator(largest, first, second);
+    };
+    for (OUT_ITEMS_VEC* run : runs)
+    {
+        sort(run->begin(), run->end(), kept_before);
+    }
+    vector<size_t> next(runs.size(), 0);
+    auto after = [&runs, &next, &kept_before](int first, int second)
+    {
+        return kept_before((*runs[second])[next[second]],
+                           (*runs[first])[next[first]]);
+    };
+    priority_queue<int, vector<int>, decltype(after)> heap(after);
+    for (size_t run = 0; run < runs.size(); run++)
+    {
+        heap.push(run);
+    }
+    OUT_ITEMS_VEC kept;
+    while (!heap.empty() && kept.size() < job->limit)
+    {
+        int run = heap.top();
+        heap.pop();
+        kept.push_back((*runs[run])[next[run]++]);
+        if (next[run] < runs[run]->size())
+        {
+            heap.push(run);
+        }
+    }
+    for (size_t run = 0; run < runs.size(); run++)
+    {
+        for (size_t i = next[run]; i < runs[run]->size(); i++)
+        {
+            delete (*runs[run])[i].first;
+            delete (*runs[run])[i].second;
+        }
+    }
+    if (largest)
+    {
+        reverse(kept.begin(), kept.end());
+    }
+    if (job->output_sink == NULL)
+    {
+        output.swap(kept);
+        return;
+    }
+    for (OUT_ITEM& item : kept)
+    {
+        job->output_sink->Write(item.first, item.second);
+    }
+}
+
+/**
+ * Keeps the limit pairs of a whole output, for the jobs that do not reduce
+ * on threads, the others are deleted.
+ * @param output
+ * @param options
+ */
+void limitOutput(OUT_ITEMS_VEC& output, const JobOptions& options)
+{
+    if (!options.sortOutput)
+    {
+        sort(output.begin(), output.end(), outputComperator);
+    }
+    if (output.size() <= options.limit)
+    {
+        return;
+    }
+    size_t drop = output.size() - options.limit;
+    OUT_ITEMS_VEC::iterator first = options.limitLargest ? output.begin() :
+                                    output.begin() + options.limit;
+    for (OUT_ITEMS_VEC::iterator it = first; it != first + drop; ++it)
+    {
+        delete it->first;
+        delete it->second;
+    }
+    output.erase(first, first + drop);
+}
+
+// PIPELINE
+
+StageChannel::StageChannel(const StageInput* next): next(next), closed(false),
+                                                    abandoned(false)
+{
+    initMutex(&mutex);
+    initCond(&changed);
+}
+
+StageChannel::~StageChannel()
+{
+    release();
+    if (pthread_mutex_destroy(&mutex))
+    {
+        cerr << ERROR_MSG_A << ERROR_DESTROY_MUTEX << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (pthread_cond_destroy(&changed))
+    {
+        cerr << ERROR_MSG_A << ERROR_DESTROY_COND << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+void StageChannel::Write(k3Base* key, v3Base* value)
+{
+    IN_ITEM item = next->FromPreviousStage(key, value);
+    lockMutex(&mutex);
+    while (queue.size() >= STAGE_CHANNEL_CAPACITY && !abandoned)
+    {
+        if (pthread_cond_wait(&changed, &mutex))
+        {
+            cerr << ERROR_MSG_A << ERROR_WAIT_COND << ERROR_MSG_B << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (abandoned)
+    {
+        unlockMutex(&mutex);
+        delete item.first;
+        delete item.second;
+        return;
+    }
+    items.push_back(item);
+    queue.push_back(item);
+    // Wakes the mappers only when the queue stops being empty.
+    if (queue.size() == 1 && pthread_cond_broadcast(&changed))
+    {
+        cerr << ERROR_MSG_A << ERROR_SIGNAL_COND << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    unlockMutex(&mutex);
+}
+
+void StageChannel::NextBatch(IN_ITEMS_VEC& batch, size_t max_items)
+{
+    lockMutex(&mutex);
+    while (queue.empty() && !closed && !abandoned)
+    {
+        if (pthread_cond_wait(&changed, &mutex))
+        {
+            cerr << ERROR_MSG_A << ERROR_WAIT_COND << ERROR_MSG_B << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    bool was_full = queue.size() >= STAGE_CHANNEL_CAPACITY;
+    while (!abandoned && !queue.empty() && batch.size() < max_items)
+    {
+        batch.push_back(queue.front());
+        queue.pop_front();
+    }
+    if (was_full && pthread_cond_broadcast(&changed))
+    {
+        cerr << ERROR_MSG_A << ERROR_SIGNAL_COND << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    unlockMutex(&mutex);
+}
+
+void StageChannel::close()
+{
+    lockMutex(&mutex);
+    closed = true;
+    if (pthread_cond_broadcast(&changed))
+    {
+        cerr << ERROR_MSG_A << ERROR_SIGNAL_COND << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    unlockMutex(&mutex);
+}
+
+void StageChannel::release()
+{
+    lockMutex(&mutex);
+    for (IN_ITEM& item : items)
+    {
+        delete item.first;
+        delete item.second;
+    }
+    IN_ITEMS_VEC().swap(items);
+    unlockMutex(&mutex);
+}
+
+void StageChannel::abandon()
+{
+    lockMutex(&mutex);
+    abandoned = true;
+    queue.clear();
+    if (pthread_cond_broadcast(&changed))
+    {
+        cerr << ERROR_MSG_A << ERROR_SIGNAL_COND << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    unlockMutex(&mutex);
+}
+
+// PROCESS MODE
+
+/**
+ * Serializes a k3 or v3 object, if it is not Serializable prints an error and
+ * exit.
+ * @param object
+ * @param is_key
+ * @param out
+ */
+void serializeOutputOrFail(const void* object, bool is_key, string& out)
+{
+    const Serializable* serializable = is_key ?
+            dynamic_cast<const Serializable*>((const k3Base*) object) :
+            dynamic_cast<const Serializable*>((const v3Base*) object);
+    if (serializable == NULL)
+    {
+        cerr << ERROR_MSG_A << ERROR_OUTPUT_FACTORY << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    serializable->Serialize(out);
+}
+
+/**
+ * Maps memory that is shared with the processes that are forked later, if
+ * there is a problem prints an error and exit.
+ * @param size
+ * @return the memory, filled with zeros.
+ */
+void* mapShared(size_t size)
+{
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        cerr << ERROR_MSG_A << ERROR_MMAP << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    return memory;
+}
+
+/**
+ * Writes a record of the current split to the segment of the calling worker
+ * process. A process whose segment is full reports the split in the control
+ * and exits, and the split runs again with a larger segment. The key and the
+ * value must be under 4 GiB each.
+ * @param key
+ * @param value
+ */
+void appendRecord(const string& key, const string& value)
+{
+    SegmentHeader* segment = process_segment;
+    if (key.size() > UINT32_MAX || value.size() > UINT32_MAX)
+    {
+        cerr << ERROR_MSG_A << ERROR_PAIR_SIZE << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    uint32_t sizes[3] = {process_split, (uint32_t) key.size(),
+                         (uint32_t) value.size()};
+    size_t record_size = sizeof(sizes) + key.size() + value.size();
+    if (segment->used + record_size > segment->capacity)
+    {
+        process_control->owners[process_split] = SEGMENT_FULL_OWNER;
+        fflush(stdout);
+        _exit(EXIT_SUCCESS);
+    }
+    char* data = (char*) (segment + 1) + segment->used;
+    memcpy(data, sizes, sizeof(sizes));
+    memcpy(data + sizeof(sizes), key.data(), key.size());
+    memcpy(data + sizeof(sizes) + key.size(), value.data(), value.size());
+    segment->used += record_size;
+}
+
+/**
+ * Runs Map on the items of one split.
+ * @param arg the input vector.
+ * @param split
+ */
+void mapSplit(void* arg, unsigned long split)
+{
+    JobContext* job = current_job;
+    IN_ITEMS_VEC* in_items_vec = (IN_ITEMS_VEC*) arg;
+    unsigned long end = min((split + 1) * job->split_size,
+                            (unsigned long) in_items_vec->size());
+    for (unsigned long i = split * job->split_size; i < end; i++)
+    {
+        job->map_reduce_base->Map((*in_items_vec)[i].first,
+                                  (*in_items_vec)[i].second);
+    }
+}
+
+/**
+ * Runs Reduce on the groups of one split.
+ * @param arg unused.
+ * @param split
+ */
+void reduceSplit(void* arg, unsigned long split)
+{
+    if (arg)
+    {
+
+    }
+    JobContext* job = current_job;
+    unsigned long end = min((split + 1) * job->split_size,
+                            (unsigned long) job->shuffle_vec.size());
+    for (unsigned long i = split * job->split_size; i < end; i++)
+    {
+        job->map_reduce_base->Reduce(job->shuffle_vec[i].first,
+                                     job->shuffle_vec[i].second);
+    }
+}
+
+/**
+ * The body of a worker process: claims the splits of the round until none is
+ * left, and marks each one it finished as its own. Never returns.
+ * @param control
+ * @param segment where the pairs of the process go.
+ * @param worker index of the segment.
+ * @param run_split
+ * @param arg
+ */
+void runWorkerProcess(ProcessControl* control, SegmentHeader* segment,
+                      int worker, void (*run_split)(void*, unsigned long),
+                      void* arg)
+{
+    // The process has its own copy of everything, MapReduceAlloc included.
+    worker_process = true;
+    WorkerState state;
+    current_worker = &state;
+    process_control = control;
+    process_segment = segment;
+    emit_record = appendRecord;
+    unsigned long index;
+    while ((index = control->next++) < control->pending_num)
+    {
+        unsigned long split = control->pending[index];
+        process_split = split;
+        run_split(arg, split);
+        control->owners[split] = worker + 1;
+    }
+    fflush(stdout);
+    _exit(EXIT_SUCCESS);
+}
+
+/**
+ * Runs the splits of a phase in forked worker processes, each with its own
+ * segment. A split whose process crashed is run again in a new round, up to
+ * splitRetries times, and then dropped. A split whose pairs did not fit is
+ * run again in a new round with segments SEGMENT_GROWTH_FACTOR times larger,
+ * which is not counted as an attempt.
+ * @param thread_name the name the workers get in the log.
+ * @param splits_num
+ * @param run_split runs one split in a worker process.
+ * @param arg of run_split.
+ * @param processes_num the most processes at once.
+ * @param options
+ * @param segments gets the segments of all the workers.
+ * @param owners gets the index of the segment of every split plus one, or 0
+ * for a dropped split.
+ */
+void runProcessPhase(const char* thread_name, unsigned long splits_num,
+                     void (*run_split)(void*, unsigned long), void* arg,
+                     int processes_num, const JobOptions& options,
+                     vector<SegmentHeader*>& segments, vector<int>& owners)
+{
+    size_t control_size = sizeof(ProcessControl) +
+            splits_num * (sizeof(unsigned long) + sizeof(atomic<int>));
+    ProcessControl* control = (ProcessControl*) mapShared(control_size);
+    control->pending = (unsigned long*) (control + 1);
+    control->owners = (atomic<int>*) (control->pending + splits_num);
+    control->pending_num = splits_num;
+    for (unsigned long i = 0; i < splits_num; i++)
+    {
+        control->pending[i] = i;
+    }
+    vector<int> attempts(splits_num, 0);
+    size_t segment_size = options.processSegmentSize;
+    while (control->pending_num > 0)
+    {
+        control->next = 0;
+        unsigned long round_processes = min((unsigned long) processes_num,
+                                            control->pending_num);
+        vector<pid_t> pids;
+        // Output that is still buffered would be printed by the children too.
+        fflush(stdout);
+        for (unsigned long i = 0; i < round_processes; i++)
+        {
+            SegmentHeader* segment = (SegmentHeader*) mapShared(segment_size);
+            segment->capacity = segment_size - sizeof(SegmentHeader);
+            segments.push_back(segment);
+            writecontentToFile(CREATE_THREAD_MSG, thread_name, NULL, NULL, 1);
+            pid_t pid = fork();
+            if (pid < 0)
+            {
+                cerr << ERROR_MSG_A << ERROR_FORK << ERROR_MSG_B << endl;
+                exit(EXIT_FAILURE);
+            }
+            if (pid == 0)
+            {
+                runWorkerProcess(control, segment, segments.size() - 1,
+                                 run_split, arg);
+            }
+            pids.push_back(pid);
+        }
+        for (pid_t pid : pids)
+        {
+            int status;
+            if (waitpid(pid, &status, 0) < 0)
+            {
+                cerr << ERROR_MSG_A << ERROR_WAITPID << ERROR_MSG_B << endl;
+                exit(EXIT_FAILURE);
+            }
+            writecontentToFile(TERMINATE_THREAD_MSG, thread_name, NULL, NULL, 1);
+        }
+        // A split without an owner was cut by a crash, or was never claimed
+        // because all the processes of the round crashed. One that was not
+        // claimed because they filled their segments did not run at all.
+        unsigned long claimed = min(control->next.load(), control->pending_num);
+        bool segment_full = false;
+        for (unsigned long i = 0; i < claimed; i++)
+        {
+            segment_full = segment_full ||
+                    control->owners[control->pending[i]] == SEGMENT_FULL_OWNER;
+        }
+        unsigned long still_pending = 0;
+        for (unsigned long i = 0; i < control->pending_num; i++)
+        {
+            unsigned long split = control->pending[i];
+            if (control->owners[split] == SEGMENT_FULL_OWNER ||
+                (i >= claimed && segment_full))
+            {
+                control->owners[split] = 0;
+                control->pending[still_pending++] = split;
+                continue;
+            }
+            if (control->owners[split] != 0)
+            {
+                continue;
+            }
+            if (++attempts[split] > options.splitRetries)
+            {
+                int split_num = (int) split;
+                writecontentToFile(SPLIT_DROPPED_MSG, NULL, &split_num, NULL, 0);
+            }
+            else
+            {
+                control->pending[still_pending++] = split;
+            }
+        }
+        control->pending_num = still_pending;
+        if (segment_full)
+        {
+            segment_size *= SEGMENT_GROWTH_FACTOR;
+        }
+    }
+    owners.assign(control->owners, control->owners + splits_num);
+    munmap(control, control_size);
+}
+
+/**
+ * Passes the records of the finished splits to use, the ones a crashed
+ * process left behind are skipped.
+ * @param segments
+ * @param owners
+ * @param use gets the key bytes, the value bytes and arg.
+ * @param arg
+ */
+void readRecords(const vector<SegmentHeader*>& segments,
+                 const vector<int>& owners,
+                 void (*use)(const char*, size_t, const char*, size_t, void*),
+                 void* arg)
+{
+    for (unsigned long worker = 0; worker < segments.size(); worker++)
+    {
+        const char* data = (const char*) (segments[worker] + 1);
+        const char* end = data + segments[worker]->used;
+        while (data < end)
+        {
+            uint32_t sizes[3];
+            memcpy(sizes, data, sizeof(sizes));
+            const char* key = data + sizeof(sizes);
+            const char* value = key + sizes[1];
+            if (owners[sizes[0]] == (int) worker + 1)
+            {
+                use(key, sizes[1], value, sizes[2], arg);
+            }
+            data = value + sizes[2];
+        }
+    }
+}
+
+/**
+ * Rebuilds an intermediate pair and adds it to the shuffle output.
+ * @param key
+ * @param key_size
+ * @param value
+ * @param value_size
+ * @param arg unused.
+ */
+void shuffleRecord(const char* key, size_t key_size, const char* value,
+                   size_t value_size, void* arg)
+{
+    if (arg)
+    {
+
+    }
+    JobContext* job = current_job;
+    k2Base* key2 = job->intermediate_factory->DeserializeK2(key, key_size);
+    v2Base* value2 = job->intermediate_factory->DeserializeV2(value, value_size);
+    SHUFFLE_LIST::iterator it = job->shuffle_output.find(key2);
+    if (it == job->shuffle_output.end())
+    {
+        job->shuffle_output[key2].push_back(value2);
+    }
+    else
+    {
+        delete key2;
+        it->second.push_back(value2);
+    }
+}
+
+/**
+ * Rebuilds an output pair.
+ * @param key
+ * @param key_size
+ * @param value
+ * @param value_size
+ * @param arg the output vector.
+ */
+void outputRecord(const char* key, size_t key_size, const char* value,
+                  size_t value_size, void* arg)
+{
+    OUT_ITEMS_VEC* out_items_vec = (OUT_ITEMS_VEC*) arg;
+    out_items_vec->push_back(OUT_ITEM(
+            current_job->output_factory->DeserializeK3(key, key_size),
+            current_job->output_factory->DeserializeV3(value, value_size)));
+}
+
+/**
+ * Unmaps the segments of a phase, which grew from round to round when a split
+ * did not fit.
+ * @param segments
+ */
+void unmapSegments(vector<SegmentHeader*>& segments)
+{
+    for (SegmentHeader* segment : segments)
+    {
+        munmap(segment, segment->capacity + sizeof(SegmentHeader));
+    }
+    segments.clear();
+}
+
+/**
+ * Runs a job with worker processes: the map processes write serialized pairs
+ * to their segments, the calling thread shuffles the rebuilt pairs, and the
+ * reduce processes write the serialized output the same way.
+ * @param mapReduce object that contains map function and reduce function.
+ * @param itemsVec the input of k1,v1.
+ * @param multiThreadLevel number of processes
+ * @param autoDeleteV2K2 boolean- if true the workers delete k2,v2 once they
+ * are written.
+ * @param options
+ * @return OUT_ITEMS_VEC vector of pairs k3,v3.
+ */
+OUT_ITEMS_VEC runProcessJob(MapReduceBase& mapReduce, IN_ITEMS_VEC& itemsVec,
+                            int multiThreadLevel, bool autoDeleteV2K2,
+                            const JobOptions& options)
+{
+    beginJob(0);
+    writecontentToFile(INIT_FRAMEWORK_MSG, NULL, &multiThreadLevel, NULL, 0);
+    JobContext job;
+    current_job = &job;
+    job.map_reduce_base = &mapReduce;
+    job.toDealloc = autoDeleteV2K2;
+    job.intermediate_factory =
+            dynamic_cast<const IntermediateFactory*>(&mapReduce);
+    job.output_factory = dynamic_cast<const OutputFactory*>(&mapReduce);
+    if (job.intermediate_factory == NULL)
+    {
+        cerr << ERROR_MSG_A << ERROR_SERIALIZABLE << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (job.output_factory == NULL)
+    {
+        cerr << ERROR_MSG_A << ERROR_OUTPUT_FACTORY << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    int processes_num = max(multiThreadLevel, 1);
+    unsigned long max_splits = (unsigned long) processes_num * SPLITS_PER_PROCESS;
+    unsigned long min_split = max(options.grainSize, 1UL);
+    vector<SegmentHeader*> segments;
+    vector<int> owners;
+    OUT_ITEMS_VEC outItemsVec = OUT_ITEMS_VEC();
+    struct timeval beginning_time;
+    struct timeval after_shuffle_time;
+    struct timeval after_reduce_time;
+    long timeElapsed;
+    if (gettimeofday(&beginning_time, NULL))
+    {
+        cerr << ERROR_MSG_A << ERROR_GET_TIME << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    job.split_size = max(min_split,
+                         (itemsVec.size() + max_splits - 1) / max_splits);
+    runProcessPhase(EXEC_MAP_NAME,
+                    (itemsVec.size() + job.split_size - 1) / job.split_size,
+                    mapSplit, &itemsVec, processes_num, options, segments,
+                    owners);
+    writecontentToFile(CREATE_THREAD_MSG, SHUFFLE_NAME, NULL, NULL, 1);
+    readRecords(segments, owners, shuffleRecord, NULL);
+    unmapSegments(segments);
+    for (SHUFFLE_LIST::iterator it = job.shuffle_output.begin();
+         it != job.shuffle_output.end(); ++it)
+    {
+        job.shuffle_vec.push_back(*it);
+    }
+    writecontentToFile(TERMINATE_THREAD_MSG, SHUFFLE_NAME, NULL, NULL, 1);
+    if (gettimeofday(&after_shuffle_time, NULL))
+    {
+        cerr << ERROR_MSG_A << ERROR_GET_TIME << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    job.split_size = max(min_split,
+                         (job.shuffle_vec.size() + max_splits - 1) / max_splits);
+    runProcessPhase(EXEC_REDUCE_NAME,
+                    (job.shuffle_vec.size() + job.split_size - 1) / job.split_size,
+                    reduceSplit, NULL, processes_num, options, segments,
+                    owners);
+    readRecords(segments, owners, outputRecord, &outItemsVec);
+    unmapSegments(segments);
+    if (gettimeofday(&after_reduce_time, NULL))
+    {
+        cerr << ERROR_MSG_A << ERROR_GET_TIME << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    timeElapsed = returnTimeDelta(beginning_time, after_shuffle_time);
+    writecontentToFile(MAP_SHUFFLE_TIME_MSG, NULL, NULL, &timeElapsed, 2);
+    job.stats.mapShuffleNanos = timeElapsed;
+    timeElapsed = returnTimeDelta(after_shuffle_time, after_reduce_time);
+    writecontentToFile(REDUCE_TIME_MSG, NULL, NULL, &timeElapsed, 2);
+    job.stats.reduceNanos = timeElapsed;
+    if (options.sortOutput)
+    {
+        sort(outItemsVec.begin(), outItemsVec.end(), outputComperator);
+    }
+    // The intermediate pairs of this process were all rebuilt here.
+    for (SHUFFLE_ITEM& group : job.shuffle_vec)
+    {
+        delete group.first;
+        for (v2Base* v2 : group.second)
+        {
+            delete v2;
+        }
+    }
+    writecontentToFile(MAPREDUCE_DONE_MSG, NULL, NULL, NULL, 3);
+    cleanResources();
+    endJob(&job, 0);
+    return outItemsVec;
+}
+
+// DISTRIBUTED MODE
+
+/**
+ * Writes all the bytes to the socket.
+ * @param fd
+ * @param data
+ * @param size
+ * @return false if the other side is gone.
+ */
+bool writeFully(int fd, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = send(fd, data, size, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+/**
+ * Reads exactly size bytes from the socket.
+ * @param fd
+ * @param data
+ * @param size
+ * @return false if the other side is gone.
+ */
+bool readFully(int fd, char* data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t got = recv(fd, data, size, 0);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            return false;
+        }
+        data += got;
+        size -= got;
+    }
+    return true;
+}
+
+/**
+ * Sends a message with its header.
+ * @param fd
+ * @param type
+ * @param id the split or the partition.
+ * @param payload
+ * @return false if the other side is gone.
+ */
+bool sendMessage(int fd, uint32_t type, uint32_t id, const string& payload)
+{
+    MessageHeader header;
+    header.type = type;
+    header.id = id;
+    header.size = payload.size();
+    return writeFully(fd, (const char*) &header, sizeof(header)) &&
+           writeFully(fd, payload.data(), payload.size());
+}
+
+/**
+ * Receives a message that sendMessage sent.
+ * @param fd
+ * @param header
+ * @param payload
+ * @return false if the other side is gone.
+ */
+bool receiveMessage(int fd, MessageHeader* header, string& payload)
+{
+    if (!readFully(fd, (char*) header, sizeof(*header)))
+    {
+        return false;
+    }
+    payload.resize(header->size);
+    return header->size == 0 || readFully(fd, &payload[0], header->size);
+}
+
+/**
+ * Appends a pair as the sizes and bytes of its key and value. The sizes take
+ * 32 bits, a key or value of 4 GiB or more prints an error and exit.
+ * @param bytes
+ * @param key
+ * @param value
+ */
+void appendPair(string& bytes, const string& key, const string& value)
+{
+    if (key.size() > UINT32_MAX || value.size() > UINT32_MAX)
+    {
+        cerr << ERROR_MSG_A << ERROR_PAIR_SIZE << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    uint32_t key_size = key.size();
+    uint32_t value_size = value.size();
+    bytes.append((const char*) &key_size, sizeof(key_size));
+    bytes.append(key);
+    bytes.append((const char*) &value_size, sizeof(value_size));
+    bytes.append(value);
+}
+
+/**
+ * Passes every pair that appendPair wrote to use.
+ * @param bytes
+ * @param use gets the key bytes, the value bytes and arg.
+ * @param arg
+ */
+void forEachPair(const string& bytes,
+                 void (*use)(const char*, size_t, const char*, size_t, void*),
+                 void* arg)
+{
+    const char* data = bytes.data();
+    const char* end = data + bytes.size();
+    while (data < end)
+    {
+        uint32_t key_size;
+        uint32_t value_size;
+        memcpy(&key_size, data, sizeof(key_size));
+        const char* key = data + sizeof(key_size);
+        memcpy(&value_size, key + key_size, sizeof(value_size));
+        const char* value = key + key_size + sizeof(value_size);
+        use(key, key_size, value, value_size, arg);
+        data = value + value_size;
+    }
+}
+
+/**
+ * Keeps an intermediate pair of a worker process in the partition of its key.
+ * Keys that are equal must serialize to the same bytes.
+ * @param key
+ * @param value
+ */
+void partitionRecord(const string& key, const string& value)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (char byte : key)
+    {
+        hash = (hash ^ (unsigned char) byte) * FNV_PRIME;
+    }
+    appendPair((*worker_partitions)[hash % worker_partitions->size()], key,
+               value);
+}
+
+/**
+ * Keeps an output pair of a worker process.
+ * @param key
+ * @param value
+ */
+void outputBytesRecord(const string& key, const string& value)
+{
+    appendPair(*worker_output, key, value);
+}
+
+/**
+ * The body of a worker process: runs the tasks the coordinator sends until it
+ * is told to exit, or the coordinator is gone. Never returns.
+ * @param fd the socket to the coordinator.
+ * @param items the input of the map splits.
+ * @param partitions_num
+ */
+void runRemoteWorker(int fd, IN_ITEMS_VEC* items, unsigned long partitions_num)
+{
+    worker_process = true;
+    WorkerState state;
+    current_worker = &state;
+    vector<string> partitions(partitions_num);
+    worker_partitions = &partitions;
+    MessageHeader header;
+    string payload;
+    while (receiveMessage(fd, &header, payload) && header.type != MSG_EXIT)
+    {
+        string reply;
+        uint32_t reply_type;
+        if (header.type == MSG_MAP)
+        {
+            emit_record = partitionRecord;
+            mapSplit(items, header.id);
+            for (uint32_t i = 0; i < partitions_num; i++)
+            {
+                if (partitions[i].empty())
+                {
+                    continue;
+                }
+                uint64_t size = partitions[i].size();
+                reply.append((const char*) &i, sizeof(i));
+                reply.append((const char*) &size, sizeof(size));
+                reply.append(partitions[i]);
+                partitions[i].clear();
+            }
+            reply_type = MSG_MAP_DONE;
+        }
+        else
+        {
+            emit_record = outputBytesRecord;
+            worker_output = &reply;
+            forEachPair(payload, shuffleRecord, NULL);
+            for (SHUFFLE_LIST::iterator it = current_job->shuffle_output.begin();
+                 it != current_job->shuffle_output.end(); ++it)
+            {
+                current_job->map_reduce_base->Reduce(it->first, it->second);
+                delete it->first;
+                for (v2Base* v2 : it->second)
+                {
+                    delete v2;
+                }
+            }
+            current_job->shuffle_output.clear();
+            reply_type = MSG_REDUCE_DONE;
+        }
+        // Everything the split made is already serialized.
+        state.arena.release();
+        if (!sendMessage(fd, reply_type, header.id, reply))
+        {
+            break;
+        }
+    }
+    fflush(stdout);
+    _exit(EXIT_SUCCESS);
+}
+
+Coordinator::Coordinator(IN_ITEMS_VEC* items, int workers_num,
+                         unsigned long partitions_num, int retries,
+                         const char* spill_directory):
+        items(items), partitions(partitions_num, NULL),
+        partition_sizes(partitions_num, 0), spill_directory(spill_directory),
+        tasks_left(0), retries(retries), phase_name(EXEC_MAP_NAME)
+{
+    for (int i = 0; i < workers_num; i++)
+    {
+        workers.push_back(spawnWorker());
+    }
+}
+
+Coordinator::RemoteWorker Coordinator::spawnWorker()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+    {
+        cerr << ERROR_MSG_A << ERROR_SOCKETPAIR << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    // Output that is still buffered would be printed by the child too.
+    fflush(stdout);
+    writecontentToFile(CREATE_THREAD_MSG, phase_name, NULL, NULL, 1);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        cerr << ERROR_MSG_A << ERROR_FORK << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0)
+    {
+        close(fds[0]);
+        for (RemoteWorker& other : workers)
+        {
+            if (other.fd >= 0)
+            {
+                close(other.fd);
+            }
+        }
+        runRemoteWorker(fds[1], items, partitions.size());
+    }
+    close(fds[1]);
+    RemoteWorker worker;
+    worker.pid = pid;
+    worker.fd = fds[0];
+    worker.busy = false;
+    worker.task = 0;
+    return worker;
+}
+
+void Coordinator::workerFailed(size_t index)
+{
+    RemoteWorker& worker = workers[index];
+    close(worker.fd);
+    worker.fd = -1;
+    kill(worker.pid, SIGKILL);
+    if (waitpid(worker.pid, NULL, 0) < 0)
+    {
+        cerr << ERROR_MSG_A << ERROR_WAITPID << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    writecontentToFile(TERMINATE_THREAD_MSG, phase_name, NULL, NULL, 1);
+    if (worker.busy)
+    {
+        if (++attempts[worker.task] > retries)
+        {
+            int task_num = (int) worker.task;
+            writecontentToFile(SPLIT_DROPPED_MSG, NULL, &task_num, NULL, 0);
+            tasks_left--;
+        }
+        else
+        {
+            pending.push_front(worker.task);
+        }
+    }
+    workers[index] = spawnWorker();
+}
+
+void Coordinator::keepPartitions(const string& payload)
+{
+    const char* data = payload.data();
+    const char* end = data + payload.size();
+    while (data < end)
+    {
+        uint32_t partition;
+        uint64_t size;
+        memcpy(&partition, data, sizeof(partition));
+        memcpy(&size, data + sizeof(partition), sizeof(size));
+        data += sizeof(partition) + sizeof(size);
+        if (partitions[partition] == NULL)
+        {
+            string path = string(spill_directory) + SPILL_FILE_TEMPLATE;
+            int fd = mkstemp(&path[0]);
+            partitions[partition] = fd < 0 ? NULL : fdopen(fd, "w+");
+            if (partitions[partition] == NULL)
+            {
+                cerr << ERROR_MSG_A << ERROR_SPILL_CREATE << ERROR_MSG_B << endl;
+                exit(EXIT_FAILURE);
+            }
+            unlink(path.c_str());
+        }
+        if (fwrite(data, 1, size, partitions[partition]) != size)
+        {
+            cerr << ERROR_MSG_A << ERROR_SPILL_WRITE << ERROR_MSG_B << endl;
+            exit(EXIT_FAILURE);
+        }
+        partition_sizes[partition] += size;
+        data += size;
+    }
+}
+
+bool Coordinator::sendPartition(int fd, uint32_t partition)
+{
+    MessageHeader header;
+    header.type = MSG_REDUCE;
+    header.id = partition;
+    header.size = partition_sizes[partition];
+    if (!writeFully(fd, (const char*) &header, sizeof(header)))
+    {
+        return false;
+    }
+    FILE* file = partitions[partition];
+    if (file == NULL)
+    {
+        return true;
+    }
+    // The file is read again from its start when the task is handed out
+    // again.
+    if (fflush(file) || fseek(file, 0, SEEK_SET))
+    {
+        cerr << ERROR_MSG_A << ERROR_SPILL_READ << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    vector<char> buffer(PARTITION_SEND_BUFFER);
+    uint64_t left = header.size;
+    while (left > 0)
+    {
+        size_t piece = min(left, (uint64_t) buffer.size());
+        if (fread(buffer.data(), 1, piece, file) != piece)
+        {
+            cerr << ERROR_MSG_A << ERROR_SPILL_READ << ERROR_MSG_B << endl;
+            exit(EXIT_FAILURE);
+        }
+        if (!writeFully(fd, buffer.data(), piece))
+        {
+            return false;
+        }
+        left -= piece;
+    }
+    return true;
+}
+
+void Coordinator::runPhase(uint32_t task_type, unsigned long tasks_num,
+                           OUT_ITEMS_VEC* out)
+{
+    const char* name = task_type == MSG_MAP ? EXEC_MAP_NAME : EXEC_REDUCE_NAME;
+    if (name != phase_name)
+    {
+        // The same processes go on with the next phase.
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            writecontentToFile(TERMINATE_THREAD_MSG, phase_name, NULL, NULL, 1);
+            writecontentToFile(CREATE_THREAD_MSG, name, NULL, NULL, 1);
+        }
+        phase_name = name;
+    }
+    pending.clear();
+    for (unsigned long i = 0; i < tasks_num; i++)
+    {
+        pending.push_back(i);
+    }
+    attempts.assign(tasks_num, 0);
+    tasks_left = tasks_num;
+    const string no_payload;
+    while (tasks_left > 0)
+    {
+        for (size_t i = 0; i < workers.size() && !pending.empty(); i++)
+        {
+            if (workers[i].busy)
+            {
+                continue;
+            }
+            workers[i].busy = true;
+            workers[i].task = pending.front();
+            pending.pop_front();
+            bool sent = task_type == MSG_REDUCE ?
+                    sendPartition(workers[i].fd, workers[i].task) :
+                    sendMessage(workers[i].fd, task_type, workers[i].task,
+                                no_payload);
+            if (!sent)
+            {
+                workerFailed(i);
+            }
+        }
+        vector<pollfd> fds(workers.size());
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            fds[i].fd = workers[i].fd;
+            fds[i].events = POLLIN;
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0)
         {
-            cerr << ERROR_MSG_A << ERROR_LOCK_MUTEX<<ERROR_MSG_B << endl;
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            cerr << ERROR_MSG_A << ERROR_POLL << ERROR_MSG_B << endl;
             exit(EXIT_FAILURE);
         }
-        unsigned long index = index_for_reduce;
-        if (index >= shuffle_vec.size())
+        for (size_t i = 0; i < workers.size(); i++)
         {
-            if (pthread_mutex_unlock(&reduce_mutex))
+            if (fds[i].revents == 0)
             {
-                cerr << ERROR_MSG_A << ERROR_UNLOCK_MUTEX <<ERROR_MSG_B << endl;
-                exit(EXIT_FAILURE);
+                continue;
             }
-            break;
+            MessageHeader header;
+            string payload;
+            if (!receiveMessage(workers[i].fd, &header, payload) ||
+                !workers[i].busy || header.id != workers[i].task)
+            {
+                workerFailed(i);
+                continue;
+            }
+            if (task_type == MSG_MAP)
+            {
+                keepPartitions(payload);
+            }
+            else
+            {
+                forEachPair(payload, outputRecord, out);
+                if (partitions[header.id] != NULL)
+                {
+                    fclose(partitions[header.id]);
+                    partitions[header.id] = NULL;
+                }
+            }
+            workers[i].busy = false;
+            tasks_left--;
         }
-        index_for_reduce += SIZE_OF_CHUNK;
-        if (pthread_mutex_unlock(&reduce_mutex))
+    }
+}
+
+void Coordinator::stop()
+{
+    for (RemoteWorker& worker : workers)
+    {
+        sendMessage(worker.fd, MSG_EXIT, 0, string());
+        close(worker.fd);
+        if (waitpid(worker.pid, NULL, 0) < 0)
         {
-            cerr << ERROR_MSG_A << ERROR_UNLOCK_MUTEX << ERROR_MSG_B << endl;
+            cerr << ERROR_MSG_A << ERROR_WAITPID << ERROR_MSG_B << endl;
             exit(EXIT_FAILURE);
         }
-        for (unsigned long i = 0; i < SIZE_OF_CHUNK &&
-                index + i < shuffle_vec.size(); i++)
+        writecontentToFile(TERMINATE_THREAD_MSG, phase_name, NULL, NULL, 1);
+    }
+    workers.clear();
+    // The partitions of dropped tasks are left.
+    for (FILE*& partition : partitions)
+    {
+        if (partition != NULL)
         {
-            SHUFFLE_ITEM cur_pair = shuffle_vec.at(i + index);
-            map_reduce_base->Reduce(cur_pair.first, cur_pair.second);
+            fclose(partition);
+            partition = NULL;
         }
     }
-    writecontentToFile(TERMINATE_THREAD_MSG, EXEC_REDUCE_NAME, NULL, NULL, 1);
-    pthread_exit(NULL);
 }
 
 /**
- * This function called at the end of the prigramm, close the file, clears all
- * data structures and destroy all mutexces.
+ * Runs a job with a coordinator, the calling thread, and worker processes
+ * that it talks to over sockets. The workers partition the pairs of every
+ * split by the hash of their key bytes, and each partition is reduced as a
+ * whole by one worker.
+ * @param mapReduce object that contains map function and reduce function.
+ * @param itemsVec the input of k1,v1.
+ * @param multiThreadLevel number of worker processes
+ * @param autoDeleteV2K2 boolean- if true the workers delete k2,v2 once they
+ * are written.
+ * @param options
+ * @return OUT_ITEMS_VEC vector of pairs k3,v3.
  */
-void cleanResources()
+OUT_ITEMS_VEC runDistributedJob(MapReduceBase& mapReduce, IN_ITEMS_VEC& itemsVec,
+                                int multiThreadLevel, bool autoDeleteV2K2,
+                                const JobOptions& options)
 {
-    if (fclose(log_file_p))
+    beginJob(0);
+    writecontentToFile(INIT_FRAMEWORK_MSG, NULL, &multiThreadLevel, NULL, 0);
+    JobContext job;
+    current_job = &job;
+    job.map_reduce_base = &mapReduce;
+    job.toDealloc = autoDeleteV2K2;
+    job.intermediate_factory =
+            dynamic_cast<const IntermediateFactory*>(&mapReduce);
+    job.output_factory = dynamic_cast<const OutputFactory*>(&mapReduce);
+    if (job.intermediate_factory == NULL)
     {
-        cerr << ERROR_MSG_A << ERROR_CLOSE_FILE<<ERROR_MSG_B << endl;
+        cerr << ERROR_MSG_A << ERROR_SERIALIZABLE << ERROR_MSG_B << endl;
         exit(EXIT_FAILURE);
     }
-    //Destroy all
-    if (pthread_mutex_destroy(&chunks_index_mutex))
+    if (job.output_factory == NULL)
     {
-        cerr << ERROR_MSG_A << ERROR_DESTROY_MUTEX << ERROR_MSG_B << endl;
+        cerr << ERROR_MSG_A << ERROR_OUTPUT_FACTORY << ERROR_MSG_B << endl;
         exit(EXIT_FAILURE);
     }
-    if (pthread_mutex_destroy(&init_containers_mutex))
+    int workers_num = max(multiThreadLevel, 1);
+    unsigned long max_splits = (unsigned long) workers_num * SPLITS_PER_PROCESS;
+    job.split_size = max(max(options.grainSize, 1UL),
+                         (itemsVec.size() + max_splits - 1) / max_splits);
+    OUT_ITEMS_VEC outItemsVec = OUT_ITEMS_VEC();
+    struct timeval beginning_time;
+    struct timeval after_shuffle_time;
+    struct timeval after_reduce_time;
+    long timeElapsed;
+    if (gettimeofday(&beginning_time, NULL))
     {
-        cerr << ERROR_MSG_A << ERROR_DESTROY_MUTEX << ERROR_MSG_B << endl;
+        cerr << ERROR_MSG_A << ERROR_GET_TIME << ERROR_MSG_B << endl;
         exit(EXIT_FAILURE);
     }
-    if (pthread_mutex_destroy(&log_file_mutex))
+    Coordinator coordinator(&itemsVec, workers_num, max_splits,
+                            options.splitRetries, options.spillDirectory);
+    // The partitions are exchanged as the map splits finish, there is no
+    // shuffle thread.
+    coordinator.runPhase(MSG_MAP,
+                         (itemsVec.size() + job.split_size - 1) /
+                         job.split_size, NULL);
+    if (gettimeofday(&after_shuffle_time, NULL))
     {
-        cerr << ERROR_MSG_A << ERROR_DESTROY_MUTEX << ERROR_MSG_B << endl;
+        cerr << ERROR_MSG_A << ERROR_GET_TIME << ERROR_MSG_B << endl;
         exit(EXIT_FAILURE);
     }
-   if (pthread_mutex_destroy(&exec_map_exist_mut))
+    coordinator.runPhase(MSG_REDUCE, max_splits, &outItemsVec);
+    coordinator.stop();
+    if (gettimeofday(&after_reduce_time, NULL))
     {
-        cerr << ERROR_MSG_A << ERROR_DESTROY_MUTEX << ERROR_MSG_B << endl;
+        cerr << ERROR_MSG_A << ERROR_GET_TIME << ERROR_MSG_B << endl;
         exit(EXIT_FAILURE);
     }
-    if (pthread_mutex_destroy(&reduce_mutex))
+    timeElapsed = returnTimeDelta(beginning_time, after_shuffle_time);
+    writecontentToFile(MAP_SHUFFLE_TIME_MSG, NULL, NULL, &timeElapsed, 2);
+    job.stats.mapShuffleNanos = timeElapsed;
+    timeElapsed = returnTimeDelta(after_shuffle_time, after_reduce_time);
+    writecontentToFile(REDUCE_TIME_MSG, NULL, NULL, &timeElapsed, 2);
+    job.stats.reduceNanos = timeElapsed;
+    if (options.sortOutput)
     {
-        cerr << ERROR_MSG_A << ERROR_DESTROY_MUTEX << ERROR_MSG_B << endl;
-        exit(EXIT_FAILURE);
+        sort(outItemsVec.begin(), outItemsVec.end(), outputComperator);
     }
-    for (map<pthread_t, mutex_t>::iterator it = container_mutexes_map.begin();
-         it != container_mutexes_map.end(); ++it)
+    writecontentToFile(MAPREDUCE_DONE_MSG, NULL, NULL, NULL, 3);
+    cleanResources();
+    endJob(&job, 0);
+    return outItemsVec;
+}
+
+/**
+ * The main function of the program, that recieves from the user the
+ * implemention to the map and the reduce functions, and dispatches the execMap
+ * and the execReduce tasks to the workers of the framework context in order to
+ * get Parallelism. The calling thread runs the shuffle while the map tasks run.
+ * @param mapReduce object that contains map function and reduce function.
+ * @param itemsVec the input of k1,v1.
+ * @param multiThreadLevel number of threads
+ * @param autoDeleteV2K2 boolean- if true the framework need to delete k2,v2.
+ * @return OUT_ITEMS_VEC vector of pairs k3,v3.
+ */
+OUT_ITEMS_VEC RunMapReduceFramework(MapReduceBase& mapReduce, IN_ITEMS_VEC &itemsVec,
+                                    int multiThreadLevel, bool autoDeleteV2K2)
+{
+    return RunMapReduceFramework(mapReduce, itemsVec, multiThreadLevel,
+                                 autoDeleteV2K2, JobOptions());
+}
+
+/**
+ * Same as above, with the optional settings of the job.
+ * @param mapReduce object that contains map function and reduce function.
+ * @param itemsVec the input of k1,v1.
+ * @param multiThreadLevel number of threads
+ * @param autoDeleteV2K2 boolean- if true the framework need to delete k2,v2.
+ * @param options
+ * @return OUT_ITEMS_VEC vector of pairs k3,v3.
+ */
+OUT_ITEMS_VEC RunMapReduceFramework(MapReduceBase& mapReduce, IN_ITEMS_VEC &itemsVec,
+                                    int multiThreadLevel, bool autoDeleteV2K2,
+                                    const JobOptions& options)
+{
+    if (options.distributed || options.useProcesses)
     {
-        if (pthread_mutex_destroy(&(it->second)))
+        if (multiThreadLevel == AUTO_THREAD_LEVEL)
         {
-            cerr << ERROR_MSG_A << ERROR_DESTROY_MUTEX << ERROR_MSG_B << endl;
-            exit(EXIT_FAILURE);
+            multiThreadLevel = processCpus();
         }
+        OUT_ITEMS_VEC outItemsVec = options.distributed ?
+                runDistributedJob(mapReduce, itemsVec, multiThreadLevel,
+                                  autoDeleteV2K2, options) :
+                runProcessJob(mapReduce, itemsVec, multiThreadLevel,
+                              autoDeleteV2K2, options);
+        if (options.limit > 0)
+        {
+            limitOutput(outItemsVec, options);
+        }
+        if (options.outputSink != NULL)
+        {
+            for (OUT_ITEM& item : outItemsVec)
+            {
+                options.outputSink->Write(item.first, item.second);
+            }
+            outItemsVec.clear();
+        }
+        return outItemsVec;
     }
-    if (sem_destroy(&semaphore))
-    {
-        cerr << ERROR_MSG_A << ERROR_SEMAPHORE_DESTORY << ERROR_MSG_B << endl;
-        exit(EXIT_FAILURE);
-    }
-    //clean data structures
-    container_mutexes_map.clear();
-    pthreadToContainer.clear();
-
-    for (SHUFFLE_LIST::iterator it = shuffle_output.begin();
-         it != shuffle_output.end(); ++it)
-    {
-        it->second.clear();
-    }
-    shuffle_output.clear();
+    return runJob(mapReduce, execMap, &itemsVec, multiThreadLevel,
+                  autoDeleteV2K2, options);
+}
 
-    for (vector<SHUFFLE_ITEM>::iterator it = shuffle_vec.begin();
-         it != shuffle_vec.end(); ++it )
-    {
-        it->second.clear();
-    }
-    shuffle_vec.clear();
+/**
+ * Same as above, the mappers read the input from the source while the job
+ * runs instead of from a vector.
+ * @param mapReduce object that contains map function and reduce function.
+ * @param source the input of k1,v1.
+ * @param multiThreadLevel number of threads
+ * @param autoDeleteV2K2 boolean- if true the framework need to delete k2,v2.
+ * @param options
+ * @return OUT_ITEMS_VEC vector of pairs k3,v3.
+ */
+OUT_ITEMS_VEC RunMapReduceFramework(MapReduceBase& mapReduce, InputSource& source,
+                                    int multiThreadLevel, bool autoDeleteV2K2,
+                                    const JobOptions& options)
+{
+    return runJob(mapReduce, execMapFromSource, &source, multiThreadLevel,
+                  autoDeleteV2K2, options);
+}
 
-    for (REDUCE_CONTAINERS::iterator it = reduce_containers.begin();
-         it != reduce_containers.end(); ++it)
+/**
+ * Starts RunMapReduceFramework on a thread of its own.
+ * @param mapReduce object that contains map function and reduce function.
+ * @param itemsVec the input of k1,v1.
+ * @param multiThreadLevel number of threads
+ * @param autoDeleteV2K2 boolean- if true the framework need to delete k2,v2.
+ * @param options
+ * @return the future output, vector of pairs k3,v3.
+ */
+future<OUT_ITEMS_VEC> SubmitJob(MapReduceBase& mapReduce, IN_ITEMS_VEC& itemsVec,
+                                int multiThreadLevel, bool autoDeleteV2K2,
+                                const JobOptions& options)
+{
+    // The options are copied, the caller's may be gone when the job starts.
+    return async(launch::async, [&mapReduce, &itemsVec, multiThreadLevel,
+                                 autoDeleteV2K2, options]()
     {
-        it->second.clear();
-    }
-    reduce_containers.clear();
+        return RunMapReduceFramework(mapReduce, itemsVec, multiThreadLevel,
+                                     autoDeleteV2K2, options);
+    });
 }
 
 /**
- * Deletes k2, v2 according to the bollean flag that gave by the user.
+ * Runs the stages of a pipeline, each on a thread of its own but the last,
+ * which runs on the calling thread.
+ * @param stages
+ * @param itemsVec the input of k1,v1 of the first stage.
+ * @return OUT_ITEMS_VEC vector of pairs k3,v3 of the last stage.
  */
-void deallocK2V2 ()
+OUT_ITEMS_VEC RunPipeline(const vector<PipelineStage>& stages,
+                          IN_ITEMS_VEC& itemsVec)
 {
-    if (toDealloc)
+    vector<StageChannel*> channels;
+    for (size_t i = 1; i < stages.size(); i++)
     {
-        for (k2Base* k2 : k2_for_delete)
+        const StageInput* next =
+                dynamic_cast<const StageInput*>(stages[i].mapReduce);
+        if (next == NULL)
         {
-            delete (k2);
+            cerr << ERROR_MSG_A << ERROR_STAGE_INPUT << ERROR_MSG_B << endl;
+            exit(EXIT_FAILURE);
         }
-        for (v2Base* v2 : v2_for_delete)
+        channels.push_back(new StageChannel(next));
+    }
+    vector<future<void>> writers;
+    for (size_t i = 0; i + 1 < stages.size(); i++)
+    {
+        JobOptions options = stages[i].options;
+        options.outputSink = channels[i];
+        options.sortOutput = false;
+        const PipelineStage& stage = stages[i];
+        StageChannel* source = i == 0 ? NULL : channels[i - 1];
+        StageChannel* channel = channels[i];
+        writers.push_back(async(launch::async,
+                [&stage, &itemsVec, source, channel, options]()
         {
-            delete (v2);
-        }
+            if (source == NULL)
+            {
+                RunMapReduceFramework(*stage.mapReduce, itemsVec,
+                                      stage.multiThreadLevel,
+                                      stage.autoDeleteV2K2, options);
+            }
+            else
+            {
+                RunMapReduceFramework(*stage.mapReduce, *source,
+                                      stage.multiThreadLevel,
+                                      stage.autoDeleteV2K2, options);
+            }
+            channel->close();
+        }));
+    }
+    const PipelineStage& last = stages.back();
+    OUT_ITEMS_VEC outItemsVec = channels.empty() ?
+            RunMapReduceFramework(*last.mapReduce, itemsVec,
+                                  last.multiThreadLevel, last.autoDeleteV2K2,
+                                  last.options) :
+            RunMapReduceFramework(*last.mapReduce, *channels.back(),
+                                  last.multiThreadLevel, last.autoDeleteV2K2,
+                                  last.options);
+    for (future<void>& writer : writers)
+    {
+        writer.get();
     }
-    k2_for_delete.clear();
-    v2_for_delete.clear();
+    for (StageChannel* channel : channels)
+    {
+        delete channel;
+    }
+    return outItemsVec;
 }
 
 /**
- * The main function of the program, that recieves from the user the
- * implemention to the map and the reduce functions, and runs the execMap
- * threads, the shuffle thread and the execReduce in order to get Parallelism.
+ * Runs a job whose map tasks read the input with the given routine.
  * @param mapReduce object that contains map function and reduce function.
- * @param itemsVec the input of k1,v1.
- * @param multiThreadLevel number of threads
+ * @param map_task the routine of the map tasks.
+ * @param map_arg the input, as map_task expects it.
+ * @param multiThreadLevel number of threads, or AUTO_THREAD_LEVEL.
  * @param autoDeleteV2K2 boolean- if true the framework need to delete k2,v2.
+ * @param options
  * @return OUT_ITEMS_VEC vector of pairs k3,v3.
  */
-OUT_ITEMS_VEC RunMapReduceFramework(MapReduceBase& mapReduce, IN_ITEMS_VEC &itemsVec,
-                                    int multiThreadLevel, bool autoDeleteV2K2)
+OUT_ITEMS_VEC runJob(MapReduceBase& mapReduce, void* (*map_task)(void*),
+                     void* map_arg, int multiThreadLevel, bool autoDeleteV2K2,
+                     const JobOptions& options)
 {
-    openLog();
+    int map_threads = multiThreadLevel;
+    int reduce_threads = multiThreadLevel;
+    bool auto_threads = multiThreadLevel == AUTO_THREAD_LEVEL;
+    if (auto_threads)
+    {
+        chooseThreadLevels(mapReduce, &map_threads, &reduce_threads);
+        multiThreadLevel = max(map_threads, reduce_threads);
+    }
+    beginJob(multiThreadLevel);
     writecontentToFile(INIT_FRAMEWORK_MSG, NULL, &multiThreadLevel, NULL, 0);
-    map_reduce_base = &mapReduce;
+    if (options.pinThreads)
+    {
+        framework_context->pinWorkers();
+    }
+    JobContext job;
+    current_job = &job;
+    job.map_reduce_base = &mapReduce;
+    job.map_arg = map_arg;
+    if (map_task == execMapFromSource)
+    {
+        job.input_source = (InputSource*) map_arg;
+    }
     OUT_ITEMS_VEC outItemsVec = OUT_ITEMS_VEC();
-    pthread_t threadsArr[multiThreadLevel];
-    pthread_t shuffle_thread;
-    initMutex(&chunks_index_mutex);
-    initMutex(&init_containers_mutex);
-    initMutex(&exec_map_exist_mut);
-    initMutex(&reduce_mutex);
-    k2_for_delete = vector<k2Base*>();
-    v2_for_delete = vector<v2Base*>();
-    index_for_reading = 0;
-    index_for_reduce = 0;
-    if (sem_init(&semaphore, 0, 0))
+    TaskGroup phase_group;
+    phase_group.pending = 0;
+    initCond(&phase_group.done_cond);
+    TaskGroup map_group;
+    map_group.pending = 0;
+    initCond(&map_group.done_cond);
+    job.grain_size = max(options.grainSize, 1UL);
+    job.phase_threads = map_threads;
+    job.auto_threads = auto_threads;
+    job.map_cpus = max(processCpus() - 1, 1);
+    if (auto_threads)
     {
-        cerr << ERROR_MSG_A << ERROR_SEMAPHORE_INIT << ERROR_MSG_B << endl;
-        exit(EXIT_FAILURE);
+        // Chunks as small as the most mappers there may be, so the first
+        // ones show soon whether to add mappers.
+        job.phase_threads = job.map_cpus * AUTO_MAX_OVERSUBSCRIPTION;
     }
+    job.map_tasks = map_threads;
+    job.map_task = map_task;
+    job.map_group = &map_group;
+    job.sort_output = options.sortOutput;
+    job.control = options.control;
+    job.output_sink = options.outputSink;
+    job.limit = options.limit;
+    job.limit_largest = options.limitLargest;
     struct timeval beginning_time;
     struct timeval after_shuffle_time;
     struct timeval after_reduce_time;
     long timeElapsed;
-    toDealloc = autoDeleteV2K2;
-    exec_map_exists = true;
-    if (gettimeofday(&beginning_time, NULL))
+    job.toDealloc = autoDeleteV2K2;
+    job.exec_map_exists = true;
+    job.active_mappers = map_threads;
+    job.busy_mappers = map_threads;
+    job.memory_budget = options.memoryBudget;
+    job.spill_directory = options.spillDirectory;
+    job.intermediate_factory =
+            dynamic_cast<const IntermediateFactory*>(&mapReduce);
+    job.associative_reducer =
+            dynamic_cast<const AssociativeReducer*>(&mapReduce);
+    job.cache_directory = options.cacheDirectory;
+    job.input_fingerprint = dynamic_cast<const InputFingerprint*>(&mapReduce);
+    job.input_factory = dynamic_cast<const InputFactory*>(&mapReduce);
+    job.speculative = map_task == execMap && autoDeleteV2K2 &&
+                      job.memory_budget == 0 && job.cache_directory == NULL &&
+                      dynamic_cast<const IdempotentMap*>(&mapReduce) != NULL;
+    if ((job.memory_budget > 0 || job.cache_directory != NULL) &&
+        job.intermediate_factory == NULL)
     {
-        cerr << ERROR_MSG_A << ERROR_GET_TIME << ERROR_MSG_B << endl;
+        cerr << ERROR_MSG_A << ERROR_SERIALIZABLE << ERROR_MSG_B << endl;
         exit(EXIT_FAILURE);
     }
-    container_mutexes_map = map<pthread_t, mutex_t>();
-    if (pthread_mutex_lock(&init_containers_mutex))
+    if (job.cache_directory != NULL && job.input_fingerprint == NULL)
     {
-        cerr << ERROR_MSG_A << ERROR_LOCK_MUTEX << ERROR_MSG_B <<endl;
+        cerr << ERROR_MSG_A << ERROR_FINGERPRINT << ERROR_MSG_B << endl;
         exit(EXIT_FAILURE);
     }
-    //Init threads
-    for(int i = 0; i < multiThreadLevel; i++)
-    {
-        if (pthread_create(&threadsArr[i], NULL, execMap, &itemsVec))
-        {
-            cerr << ERROR_MSG_A << ERROR_CREATE << ERROR_MSG_B << endl;
-            exit(EXIT_FAILURE);
-        }
-    }
-    for (int i = 0; i < multiThreadLevel; i++)
+    if (gettimeofday(&beginning_time, NULL))
     {
-        pthreadToContainer[threadsArr[i]] = MAP_OUTPUT_LIST();
-        initMutex(&container_mutexes_map[threadsArr[i]]);
+        cerr << ERROR_MSG_A << ERROR_GET_TIME << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
     }
-    if (pthread_mutex_unlock(&init_containers_mutex))
+    if (job.control != NULL)
     {
-        cerr << ERROR_MSG_A << ERROR_UNLOCK_MUTEX << ERROR_MSG_B << endl;
-        exit(EXIT_FAILURE);
+        startControl(job.control);
+        job.attachControl();
     }
-    if (pthread_create(&shuffle_thread, NULL, shuffleWork, NULL))
+    //Dispatch the map tasks, the calling thread does the shuffle meanwhile
+    for(int i = 0; i < map_threads; i++)
     {
-        cerr << ERROR_MSG_A << ERROR_CREATE << ERROR_MSG_B << endl;
-        exit(EXIT_FAILURE);
+        framework_context->submit(map_task, &job, &map_group);
     }
     writecontentToFile(CREATE_THREAD_MSG, SHUFFLE_NAME, NULL, NULL, 1);
-    //JOIN with all other threads
-    for (int i = 0; i < multiThreadLevel; i++)
+    cpu_set_t caller_cpus;
+    if (options.pinThreads)
     {
-        if(pthread_join(threadsArr[i], NULL))
-        {
-            cerr << ERROR_MSG_A << ERROR_JOIN << ERROR_MSG_B << endl;
-            exit(EXIT_FAILURE);
-        }
+        pinCallingThread(framework_context->cpus[SHUFFLE_CPU], &caller_cpus);
     }
-    exec_map_exists = false;
-    if (sem_post(&semaphore))
+    shuffleWork(&job);
+    if (options.pinThreads &&
+        pthread_setaffinity_np(pthread_self(), sizeof(caller_cpus),
+                               &caller_cpus))
     {
-        cerr << ERROR_MSG_A << ERROR_SEMAPHORE_POST <<ERROR_MSG_B << endl;
+        cerr << ERROR_MSG_A << ERROR_AFFINITY << ERROR_MSG_B << endl;
         exit(EXIT_FAILURE);
     }
-    if (pthread_join(shuffle_thread, NULL))
+    if (job.speculative)
     {
-        cerr << ERROR_MSG_A << ERROR_JOIN << ERROR_MSG_B << endl;
-        exit(EXIT_FAILURE);
+        // The runs that lost keep their workers until their Map call returns.
+        job.phase_threads = max(reduce_threads - runningAttempts(&job), 1);
+    }
+    else
+    {
+        framework_context->wait(&map_group);
+        job.phase_threads = reduce_threads;
+        // The items a previous stage of a pipeline sent are not needed once
+        // they are mapped.
+        StageChannel* channel = dynamic_cast<StageChannel*>(job.input_source);
+        if (channel != NULL)
+        {
+            channel->release();
+        }
     }
     if (gettimeofday(&after_shuffle_time, NULL))
     {
         cerr << ERROR_MSG_A << ERROR_GET_TIME << ERROR_MSG_B << endl;
         exit(EXIT_FAILURE);
     }
-    if (pthread_mutex_lock(&init_containers_mutex))
+    if (job.control != NULL)
     {
-        cerr << ERROR_MSG_A << ERROR_LOCK_MUTEX << ERROR_MSG_B  << endl;
-        exit(EXIT_FAILURE);
+        job.control->reduceStartNanos = nowNanos();
     }
-    for(int i = 0; i < multiThreadLevel; i++)
+    if (job.spill_runs.empty())
     {
-        if (pthread_create(&threadsArr[i], NULL, execReduce, NULL))
+        if (job.limit > 0 && options.reduceKeepsKeyOrder)
         {
-            cerr << ERROR_MSG_A << ERROR_CREATE << ERROR_MSG_B << endl;
-            exit(EXIT_FAILURE);
+            skipGroupsOverLimit(&job);
+        }
+        if (job.associative_reducer != NULL)
+        {
+            splitHotKeys(&job, &phase_group);
+        }
+        if (job.control != NULL)
+        {
+            job.control->keysTotal = job.shuffle_vec.size();
+        }
+        for(int i = 0; i < job.phase_threads; i++)
+        {
+            framework_context->submit(execReduce, &job, &phase_group);
         }
+        framework_context->wait(&phase_group);
     }
-    for (int i = 0; i < multiThreadLevel; i++)
+    else
     {
-        reduce_containers[threadsArr[i]] = OUT_ITEMS_VEC();
+        reduceSpilledRuns(&job, &phase_group);
     }
-    if (pthread_mutex_unlock(&init_containers_mutex))
+    framework_context->wait(&map_group);
+    if (pthread_cond_destroy(&phase_group.done_cond) ||
+        pthread_cond_destroy(&map_group.done_cond))
     {
-        cerr << ERROR_MSG_A << ERROR_UNLOCK_MUTEX << ERROR_MSG_B << endl;
+        cerr << ERROR_MSG_A << ERROR_DESTROY_COND << ERROR_MSG_B << endl;
         exit(EXIT_FAILURE);
     }
-    for (int i = 0; i < multiThreadLevel; i++)
-    {
-        if (pthread_join(threadsArr[i], NULL))
-        {
-            cerr << ERROR_MSG_A << ERROR_JOIN << ERROR_MSG_B << endl;
-            exit(EXIT_FAILURE);
-        }
-    }
     if (gettimeofday(&after_reduce_time, NULL))
     {
         cerr << ERROR_MSG_A << ERROR_GET_TIME << ERROR_MSG_B << endl;
         exit(EXIT_FAILURE);
     }
+    if (job.control != NULL)
+    {
+        job.control->endNanos = nowNanos();
+        job.detachControl();
+    }
     timeElapsed = returnTimeDelta(beginning_time, after_shuffle_time);
     writecontentToFile(MAP_SHUFFLE_TIME_MSG, NULL, NULL, &timeElapsed, 2);
+    job.stats.mapShuffleNanos = timeElapsed;
     timeElapsed = returnTimeDelta(after_shuffle_time, after_reduce_time);
     writecontentToFile(REDUCE_TIME_MSG, NULL, NULL, &timeElapsed, 2);
-    for (REDUCE_CONTAINERS::iterator it = reduce_containers.begin();
-         it != reduce_containers.end(); ++it)
+    job.stats.reduceNanos = timeElapsed;
+    job.stats.cachedItems = job.cached_items;
+    mergeOutputs(&job, outItemsVec);
+    if (options.pinThreads)
     {
-        for (OUT_ITEM out_pair: it->second)
-        {
-            outItemsVec.push_back(out_pair);
-        }
+        framework_context->unpinWorkers();
     }
-    sort(outItemsVec.begin(), outItemsVec.end(), outputComperator);
-    deallocK2V2();
+    deallocK2V2(&job);
     writecontentToFile(MAPREDUCE_DONE_MSG, NULL, NULL, NULL, 3);
     cleanResources();
+    endJob(&job, multiThreadLevel);
     return outItemsVec;
 }
 
+/**
+ * Runs one task of RunOnWorkers.
+ * @param ptr the WorkerCall.
+ * @return null.
+ */
+void* runWorkerCall(void* ptr)
+{
+    WorkerCall* call = (WorkerCall*) ptr;
+    call->routine(call->arg, call->task);
+    return NULL;
+}
+
+/**
+ * Runs routine(arg, task) for every task in [0, tasks) on the workers of the
+ * framework and waits for all of them.
+ * @param tasks
+ * @param routine
+ * @param arg
+ */
+void RunOnWorkers(int tasks, void (*routine)(void* arg, int task), void* arg)
+{
+    if (tasks <= 0)
+    {
+        cerr << ERROR_MSG_A << ERROR_TASKS << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    lockMutex(&context_mutex);
+    if (framework_context == NULL)
+    {
+        framework_context = new FrameworkContext();
+    }
+    framework_context->ensureWorkers(tasks);
+    unlockMutex(&context_mutex);
+    vector<WorkerCall> calls(tasks);
+    TaskGroup group;
+    group.pending = 0;
+    initCond(&group.done_cond);
+    for (int i = 0; i < tasks; i++)
+    {
+        calls[i].routine = routine;
+        calls[i].arg = arg;
+        calls[i].task = i;
+        framework_context->submit(runWorkerCall, &calls[i], &group);
+    }
+    framework_context->wait(&group);
+    if (pthread_cond_destroy(&group.done_cond))
+    {
+        cerr << ERROR_MSG_A << ERROR_DESTROY_COND << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @return the number of CPUs the process may run on.
+ */
+int GetProcessCpus()
+{
+    return processCpus();
+}
+
+/**
+ * @return the times of the last job that finished.
+ */
+JobStats GetLastJobStats()
+{
+    lockMutex(&context_mutex);
+    JobStats stats = last_job_stats;
+    unlockMutex(&context_mutex);
+    return stats;
+}
+
+/**
+ * Stops the workers of the framework and releases the objects that are kept
+ * between RunMapReduceFramework calls.
+ */
+void ReleaseMapReduceFramework()
+{
+    delete framework_context;
+    framework_context = NULL;
+}
+
+/**
+ * Adds an item to the input of the job of the calling mapper. When the map
+ * phase is speculative the item waits for the run of the chunk to finish,
+ * and is dropped if another run won.
+ * @param key1 pointer
+ * @param value1 pointer
+ */
+void Emit1(k1Base* key1, v1Base* value1)
+{
+    if (emit_record != NULL || current_job == NULL ||
+        (!current_job->exec_map_exists && !current_job->speculative))
+    {
+        cerr << ERROR_MSG_A << ERROR_EMIT1 << ERROR_MSG_B << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (current_worker->cache_record != NULL &&
+        !recordItem(key1, value1, *current_worker->cache_record))
+    {
+        current_worker->uncached_items = true;
+    }
+    if (current_job->speculative)
+    {
+        current_worker->attempt_items.push_back(IN_ITEM(key1, value1));
+        return;
+    }
+    addItem(current_job, IN_ITEM(key1, value1));
+}
+
 /**
  * Function that the map use in order to insert the result for the shuffle
  * function.
@@ -695,24 +5645,52 @@ OUT_ITEMS_VEC RunMapReduceFramework(MapReduceBase& mapReduce, IN_ITEMS_VEC &item
  */
 void Emit2(k2Base* key2, v2Base* value2)
 {
-    if (sem_post(&semaphore))
+    if (emit_record != NULL)
     {
-        cerr << ERROR_MSG_A << ERROR_SEMAPHORE_POST << ERROR_MSG_B << endl;
-        exit(EXIT_FAILURE);
+        string key_bytes;
+        string value_bytes;
+        serializeOrFail(key2, true, key_bytes);
+        serializeOrFail(value2, false, value_bytes);
+        emit_record(key_bytes, value_bytes);
+        if (current_job->toDealloc && !current_worker->arena.owns(key2))
+        {
+            delete key2;
+        }
+        if (current_job->toDealloc && !current_worker->arena.owns(value2))
+        {
+            delete value2;
+        }
+        return;
     }
-    MAP_OUTPUT_TYPE cur_pair(key2, value2);
-    if (pthread_mutex_lock(&(container_mutexes_map[pthread_self()])))
+    if (current_worker->cache_record != NULL)
     {
-        cerr << ERROR_MSG_A << ERROR_LOCK_MUTEX << ERROR_MSG_B << endl;
-        exit(EXIT_FAILURE);
+        string key_bytes(1, CACHE_PAIR_TAG);
+        string value_bytes;
+        serializeOrFail(key2, true, key_bytes);
+        serializeOrFail(value2, false, value_bytes);
+        appendPair(*current_worker->cache_record, key_bytes, value_bytes);
     }
-    pthreadToContainer[pthread_self()].push_back(cur_pair);
-    if (pthread_mutex_unlock(&(container_mutexes_map[pthread_self()])))
+    if (current_job->speculative)
     {
-        cerr << ERROR_MSG_A << ERROR_UNLOCK_MUTEX << ERROR_MSG_B << endl;
-        exit(EXIT_FAILURE);
+        current_worker->attempt_pairs.push_back(MAP_OUTPUT_TYPE(key2, value2));
+        return;
+    }
+    if (current_job->control != NULL)
+    {
+        current_job->control->pairsEmitted.fetch_add(1, memory_order_relaxed);
+    }
+    if (current_job->memory_budget > 0)
+    {
+        bufferForSpill(key2, value2);
+        return;
+    }
+    // The shuffle gets the pairs in batches, and the rest when the map task
+    // ends.
+    current_worker->pair_buffer.push_back(MAP_OUTPUT_TYPE(key2, value2));
+    if (current_worker->pair_buffer.size() >= SHUFFLE_BATCH_SIZE)
+    {
+        handOverBuffer();
     }
-
 }
 
 /**
@@ -723,6 +5701,36 @@ void Emit2(k2Base* key2, v2Base* value2)
  */
 void Emit3(k3Base* key3, v3Base* val3)
 {
+    if (emit_record != NULL)
+    {
+        // The caller gets rebuilt copies, these stay in the worker process.
+        string key_bytes;
+        string value_bytes;
+        serializeOutputOrFail(key3, true, key_bytes);
+        serializeOutputOrFail(val3, false, value_bytes);
+        emit_record(key_bytes, value_bytes);
+        delete key3;
+        delete val3;
+        return;
+    }
+    if (current_job->limit > 0)
+    {
+        keepInLimit(OUT_ITEM(key3, val3));
+        return;
+    }
+    if (current_job->output_sink != NULL && !current_job->sort_output)
+    {
+        OutputSink* sink = current_job->output_sink;
+        if (sink->ConcurrentWrites())
+        {
+            sink->Write(key3, val3);
+            return;
+        }
+        lockMutex(&current_job->sink_mutex);
+        sink->Write(key3, val3);
+        unlockMutex(&current_job->sink_mutex);
+        return;
+    }
     OUT_ITEM cur_pair(key3,val3);
-    reduce_containers[pthread_self()].push_back(cur_pair);
+    current_worker->reduce_output.push_back(cur_pair);
 }
\ No newline at end of file
@@ -0,0 +1,420 @@
+#ifndef EX3_MAPREDUCEFRAMEWORKEXT_H
+#define EX3_MAPREDUCEFRAMEWORKEXT_H
+
+#include <atomic>
+#include <future>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "MapReduceFramework.h"
+#include "MapReduceClientExt.h"
+
+/*
+ * Additions to the MapReduceFramework API.
+ */
+
+/*
+ * Given as the multiThreadLevel of a job, lets the framework pick it: a
+ * reducer for every CPU the process may run on, and a mapper for every CPU
+ * but the one of the shuffle. While the mappers run, more of them are added
+ * as long as they are blocked for much of their time, and the next job of
+ * the same MapReduceBase class starts with as many as that one needed. Jobs
+ * of processes get one process per CPU.
+ */
+#define AUTO_THREAD_LEVEL 0
+
+/*
+ * What a running job has done so far, see JobControl.
+ */
+struct JobProgress {
+    // Input items that went through Map.
+    unsigned long itemsMapped;
+    // Pairs that Map emitted.
+    unsigned long pairsEmitted;
+    // Emitted pairs that the shuffle did not take yet.
+    unsigned long shuffleBacklog;
+    // Keys that went through Reduce, out of keysTotal, which is known once
+    // the shuffle is done, or grows batch by batch when the job spilled.
+    unsigned long keysReduced;
+    unsigned long keysTotal;
+    // Time of the map and shuffle phase and of the reduce phase up to now,
+    // in nano seconds.
+    long mapShuffleNanos;
+    long reduceNanos;
+};
+
+class JobContext;
+
+/*
+ * Watches and stops a job from another thread. Given to the job through
+ * JobOptions::control, it must stay alive until the job returns, and can be
+ * given to the next job after it. Only jobs that run on threads use it.
+ */
+class JobControl {
+public:
+    /*
+     * Constructor.
+     */
+    JobControl();
+    /**
+     * @return what the job has done so far.
+     */
+    JobProgress Progress() const;
+    /**
+     * Asks the job to stop. Its workers stop when they finish the chunk they
+     * are working on, mappers that wait for Emit1 items or for the previous
+     * stage of a pipeline wake up, and the job returns the output of the keys
+     * that were already reduced, the rest of the input is not processed.
+     * Applies to the job that runs with the control, or to the next one that
+     * starts with it when none runs. The job clears it when it returns, so
+     * the control can be given to the next job.
+     */
+    void Cancel();
+    /**
+     * @return true if Cancel was called.
+     */
+    bool IsCancelled() const;
+
+    // Updated by the framework while the job runs.
+    std::atomic<unsigned long> itemsMapped;
+    std::atomic<unsigned long> pairsEmitted;
+    std::atomic<unsigned long> pairsShuffled;
+    std::atomic<unsigned long> keysReduced;
+    std::atomic<unsigned long> keysTotal;
+    // When the phases started and the job ended, on the CLOCK_MONOTONIC
+    // clock in nano seconds, 0 until then.
+    std::atomic<long> mapStartNanos;
+    std::atomic<long> reduceStartNanos;
+    std::atomic<long> endNanos;
+
+private:
+    friend class JobContext;
+    std::atomic<bool> cancelled;
+    // The job that runs with the control, NULL between jobs.
+    JobContext* job;
+};
+
+/*
+ * Receives the output of a job as it is produced, instead of the vector that
+ * RunMapReduceFramework returns, so the output can go straight to a file or a
+ * socket.
+ */
+class OutputSink {
+public:
+    virtual ~OutputSink() {}
+    /**
+     * Takes one output pair. The calls come one at a time, but from any of
+     * the workers, unless ConcurrentWrites is true. The pair belongs to the
+     * sink, as the output always belongs to the client.
+     * @param key
+     * @param value
+     */
+    virtual void Write(k3Base* key, v3Base* value) = 0;
+    /**
+     * Whether Write locks by itself, so the workers may call it at the same
+     * time. A Write that blocks should return true, so one waiting reducer
+     * does not hold up the others.
+     * @return false by default.
+     */
+    virtual bool ConcurrentWrites() const { return false; }
+};
+
+/*
+ * Optional settings of a job, the defaults keep the behaviour of the plain
+ * RunMapReduceFramework call.
+ */
+struct JobOptions {
+    /*
+     * The least number of items a map or reduce task claims at once. Tasks
+     * claim a fraction of the work that is left, shrinking down to this size
+     * at the end of the phase. Raise it when single items are very cheap.
+     * Also the least batch asked from an InputSource.
+     */
+    unsigned long grainSize;
+    /*
+     * Bytes of intermediate pairs the mappers may keep in memory, 0 for no
+     * limit. Above it the mappers spill sorted runs to files and the reduce
+     * phase merges them back. Requires the hooks of MapReduceClientExt.h:
+     * k2 and v2 must be Serializable and mapReduce an IntermediateFactory.
+     * Spilled pairs are handed to Reduce as rebuilt copies.
+     */
+    size_t memoryBudget;
+    /*
+     * Where the spilled runs are written, and the partitions in distributed
+     * mode. They are unlinked right away.
+     */
+    const char* spillDirectory;
+    /*
+     * Runs the map and reduce workers as forked processes instead of threads,
+     * so a Map or Reduce that crashes does not take the job down: the split it
+     * was working on is run again by another process, and dropped if it fails
+     * again. The pairs come back to the caller through shared memory, so k2,
+     * v2, k3 and v3 must be Serializable and mapReduce both an
+     * IntermediateFactory and an OutputFactory. Reduce gets rebuilt copies of
+     * the pairs. Applies to the vector input only, memoryBudget is ignored.
+     */
+    bool useProcesses;
+    /*
+     * Bytes of shared memory reserved for the pairs of one worker process,
+     * pages are only used once they are written. A split whose pairs do not
+     * fit runs again with segments twice as large.
+     */
+    size_t processSegmentSize;
+    /*
+     * Runs the job on multiThreadLevel worker processes that the calling
+     * thread coordinates over Unix sockets. The coordinator hands out the map
+     * splits, the workers partition their pairs by the hash of the serialized
+     * key and send them back, and every partition is then reduced by one
+     * worker. A worker that fails is replaced and its task is handed to
+     * another one. Needs the same hooks as useProcesses, and equal keys must
+     * serialize to equal bytes.
+     */
+    bool distributed;
+    /*
+     * How many times a split whose process crashed is run again.
+     */
+    int splitRetries;
+    /*
+     * Whether the output is sorted by the operator< of k3. Without it the
+     * output comes in no particular order, and when k2 is a HashableKey and
+     * nothing is spilled the job does not compare keys at all.
+     */
+    bool sortOutput;
+    /*
+     * Reports the progress of the job and lets another thread cancel it,
+     * NULL for neither.
+     */
+    JobControl* control;
+    /*
+     * Receives the output instead of the returned vector, which is then
+     * empty. Without sortOutput every pair goes to the sink as soon as Reduce
+     * emits it. With sortOutput the sorted outputs of the reducers are merged
+     * into the sink at the end, without building the vector. Jobs in process
+     * or distributed mode build the output first and then write it.
+     */
+    OutputSink* outputSink;
+    /*
+     * Keeps only this many output pairs, the ones with the smallest k3, or
+     * the largest with limitLargest, 0 keeps them all. The kept pairs come
+     * sorted whatever sortOutput is, and the framework deletes the k3 and v3
+     * objects of the others.
+     */
+    size_t limit;
+    bool limitLargest;
+    /*
+     * Tells the framework that every Reduce call emits at least one pair and
+     * that the k3 keys keep the order of their k2 keys, as when Reduce emits
+     * its own key. With a limit, only that many of the smallest or largest
+     * k2 keys are then reduced at all. Not used by jobs that spill.
+     */
+    bool reduceKeepsKeyOrder;
+    /*
+     * Directory where the pairs Map emits for every input item are kept, one
+     * file per item, NULL for no cache. mapReduce must be an
+     * InputFingerprint: an item whose name and fingerprint match a file of an
+     * earlier run is not mapped again, the pairs of the file are rebuilt and
+     * shuffled instead. Needs the same hooks as memoryBudget, and the
+     * framework deletes the rebuilt pairs. Applies to jobs of threads only,
+     * and turns off the speculative runs of an IdempotentMap. The items Map
+     * adds with Emit1 are kept with the pairs, see InputFactory. Files of
+     * items that are no longer in the input stay in the directory.
+     */
+    const char* cacheDirectory;
+    /*
+     * Pins every worker of the framework to a CPU of its own, in turn, and
+     * the thread that shuffles the job to another one, so the scheduler does
+     * not move them around. The workers get their CPUs back when the job
+     * ends, or when the last of the jobs that pin and run at once ends. Jobs
+     * that run meanwhile share the pinned workers.
+     */
+    bool pinThreads;
+
+    JobOptions(): grainSize(1), memoryBudget(0), spillDirectory("/tmp"),
+                  useProcesses(false), processSegmentSize(256UL << 20),
+                  distributed(false), splitRetries(1), sortOutput(true),
+                  control(NULL), outputSink(NULL), limit(0),
+                  limitLargest(false), reduceKeepsKeyOrder(false),
+                  cacheDirectory(NULL), pinThreads(false) {}
+};
+
+/**
+ * Same as RunMapReduceFramework, with the optional settings of the job.
+ * @param mapReduce object that contains map function and reduce function.
+ * @param itemsVec the input of k1,v1.
+ * @param multiThreadLevel number of threads
+ * @param autoDeleteV2K2 boolean- if true the framework need to delete k2,v2.
+ * @param options
+ * @return OUT_ITEMS_VEC vector of pairs k3,v3.
+ */
+OUT_ITEMS_VEC RunMapReduceFramework(MapReduceBase& mapReduce, IN_ITEMS_VEC& itemsVec,
+                                    int multiThreadLevel, bool autoDeleteV2K2,
+                                    const JobOptions& options);
+
+/*
+ * Produces the input of a job in batches while the job runs, so producing the
+ * input overlaps with mapping and only a few batches are held at once.
+ */
+class InputSource {
+public:
+    virtual ~InputSource() {}
+    /**
+     * Fills the batch with the next input items, an empty batch ends the
+     * input. The mappers call it whenever they run out of items, one call at
+     * a time. As with the vector input, the items belong to the client.
+     * @param batch empty vector to fill.
+     * @param max_items the most items the mapper wants now.
+     */
+    virtual void NextBatch(IN_ITEMS_VEC& batch, size_t max_items) = 0;
+};
+
+/**
+ * Same as RunMapReduceFramework, the mappers read the input from the source
+ * while the job runs instead of from a vector.
+ * @param mapReduce object that contains map function and reduce function.
+ * @param source the input of k1,v1.
+ * @param multiThreadLevel number of threads
+ * @param autoDeleteV2K2 boolean- if true the framework need to delete k2,v2.
+ * @param options
+ * @return OUT_ITEMS_VEC vector of pairs k3,v3.
+ */
+OUT_ITEMS_VEC RunMapReduceFramework(MapReduceBase& mapReduce, InputSource& source,
+                                    int multiThreadLevel, bool autoDeleteV2K2,
+                                    const JobOptions& options = JobOptions());
+
+/**
+ * Starts RunMapReduceFramework on a thread of its own and returns at once.
+ * Every job keeps its state in a context of its own, so any number of jobs
+ * may run at the same time: they share the workers of the framework, which
+ * grow to the sum of the multiThreadLevel of the running jobs, so a small job
+ * does not wait for a big one to finish. The returned future must be kept
+ * until get() or wait() returns, dropping it waits for the job.
+ * A job in process or distributed mode forks, run such jobs alone.
+ * @param mapReduce object that contains map function and reduce function,
+ * must stay alive until the job finishes.
+ * @param itemsVec the input of k1,v1, must stay alive until the job finishes.
+ * @param multiThreadLevel number of threads
+ * @param autoDeleteV2K2 boolean- if true the framework need to delete k2,v2.
+ * @param options
+ * @return the future output, vector of pairs k3,v3.
+ */
+std::future<OUT_ITEMS_VEC> SubmitJob(MapReduceBase& mapReduce,
+                                     IN_ITEMS_VEC& itemsVec,
+                                     int multiThreadLevel, bool autoDeleteV2K2,
+                                     const JobOptions& options = JobOptions());
+
+/*
+ * One job of a pipeline.
+ */
+struct PipelineStage {
+    MapReduceBase* mapReduce;
+    int multiThreadLevel;
+    bool autoDeleteV2K2;
+    JobOptions options;
+};
+
+/**
+ * Runs jobs one after the other, the output of every stage is the input of
+ * the next. The stages run at the same time on the workers of the framework:
+ * the output pairs of a stage pass in batches to the mappers of the next one
+ * as soon as they are reduced, without gathering the output vector of the
+ * stage. The mapReduce of every stage but the first must be a StageInput.
+ * Only the last stage uses sortOutput and outputSink, and its output is the
+ * output of the pipeline.
+ * @param stages
+ * @param itemsVec the input of k1,v1 of the first stage.
+ * @return OUT_ITEMS_VEC vector of pairs k3,v3 of the last stage.
+ */
+OUT_ITEMS_VEC RunPipeline(const std::vector<PipelineStage>& stages,
+                          IN_ITEMS_VEC& itemsVec);
+
+/**
+ * Adds an item to the input of the job, called by Map for input it finds
+ * while it runs, as the subdirectories of a directory. The item is mapped by
+ * whichever mapper is free, and the map phase ends once no item is left and
+ * no Map call that may add more still runs. The framework deletes the key and
+ * the value when the job ends. Only jobs that run on threads can add items.
+ * With a cacheDirectory, the items are cached with the pairs of the call
+ * when mapReduce is an InputFactory and the items are Serializable, and the
+ * call is not cached otherwise.
+ * @param key1
+ * @param value1 may be null.
+ */
+void Emit1(k1Base* key1, v1Base* value1);
+
+/**
+ * Returns memory for an intermediate object from the arena of the calling
+ * mapper. Use MapReduceAlloc instead of calling it directly.
+ * @param size of the object.
+ * @param destroy function that destroys the object, or NULL.
+ * @return the memory.
+ */
+void* AllocIntermediate(size_t size, void (*destroy)(void*));
+
+/**
+ * Destroys an object that was created by MapReduceAlloc.
+ * @param object
+ */
+template <class T>
+void DestroyIntermediate(void* object)
+{
+    static_cast<T*>(object)->~T();
+}
+
+/**
+ * Creates a k2 or v2 object inside Map, from the arena of the job instead of
+ * the heap. Such objects belong to the framework: they are valid until
+ * RunMapReduceFramework returns and are then released all together, whatever
+ * autoDeleteV2K2 is. They can be mixed with heap allocated ones.
+ * @param args the arguments of the constructor of T.
+ * @return the new object.
+ */
+template <class T, class... Args>
+T* MapReduceAlloc(Args&&... args)
+{
+    static_assert(alignof(T) <= 16, "MapReduceAlloc aligns to 16 bytes");
+    void* memory = AllocIntermediate(sizeof(T),
+            std::is_trivially_destructible<T>::value ?
+            NULL : DestroyIntermediate<T>);
+    return new (memory) T(std::forward<Args>(args)...);
+}
+
+/**
+ * Runs routine(arg, task) for every task in [0, tasks) on the workers of the
+ * framework and waits for all of them. Used by the typed front-end.
+ * @param tasks a positive number of tasks.
+ * @param routine
+ * @param arg
+ */
+void RunOnWorkers(int tasks, void (*routine)(void* arg, int task), void* arg);
+
+/**
+ * @return the number of CPUs the process may run on, what AUTO_THREAD_LEVEL
+ * stands for in the typed front-end.
+ */
+int GetProcessCpus();
+
+/*
+ * The times the framework writes to the log for a job, in nano seconds.
+ */
+struct JobStats {
+    long mapShuffleNanos;
+    long reduceNanos;
+    // Input items whose pairs came from the cache instead of Map.
+    unsigned long cachedItems;
+};
+
+/**
+ * @return the times of the last job that finished, of any of them when jobs
+ * run at the same time.
+ */
+JobStats GetLastJobStats();
+
+/**
+ * The framework keeps its worker threads, the log file and the
+ * synchronization objects alive between RunMapReduceFramework calls. This
+ * stops the workers and releases all of them, the next call creates them
+ * again. Must not be called while a job is running.
+ */
+void ReleaseMapReduceFramework();
+
+#endif //EX3_MAPREDUCEFRAMEWORKEXT_H
@@ -0,0 +1,303 @@
+#ifndef EX3_MAPREDUCETYPED_H
+#define EX3_MAPREDUCETYPED_H
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+#include "MapReduceFrameworkExt.h"
+
+/*
+ * Typed front-end of the framework. Keys and values are stored by value in
+ * contiguous buffers, and the comparators and the hasher are template
+ * arguments, so grouping and sorting do not go through virtual calls or
+ * pointers. The map output is partitioned by the hash of k2, every reduce
+ * task sorts and groups its own partition, and the sorted outputs of the
+ * reduce tasks are merged at the end. Jobs run on the workers of the
+ * framework context. Clients derive from it and implement Map and Reduce.
+ */
+template <class K1, class V1, class K2, class V2, class K3, class V3,
+          class Less2 = std::less<K2>, class Hash2 = std::hash<K2>,
+          class Less3 = std::less<K3>>
+class MapReduce {
+public:
+    typedef std::vector<std::pair<K1, V1>> InputVec;
+    typedef std::vector<std::pair<K3, V3>> OutputVec;
+
+    /*
+     * Collects the pairs that one map task emits.
+     */
+    class MapOutput {
+    public:
+        void Emit(K2 key, V2 value)
+        {
+            pairs.emplace_back(std::move(key), std::move(value));
+        }
+
+    private:
+        friend class MapReduce;
+        std::vector<std::pair<K2, V2>> pairs;
+    };
+
+    /*
+     * Collects the pairs that one reduce task emits.
+     */
+    class ReduceOutput {
+    public:
+        void Emit(K3 key, V3 value)
+        {
+            pairs.emplace_back(std::move(key), std::move(value));
+        }
+
+    private:
+        friend class MapReduce;
+        OutputVec pairs;
+    };
+
+    virtual ~MapReduce() {}
+
+    /**
+     * Maps one input item.
+     * @param key
+     * @param value
+     * @param out where the k2, v2 pairs are emitted.
+     */
+    virtual void Map(const K1& key, const V1& value, MapOutput& out) const = 0;
+
+    /**
+     * Reduces all the values of one key, they are contiguous in memory.
+     * @param key
+     * @param begin first value.
+     * @param end one past the last value.
+     * @param out where the k3, v3 pairs are emitted.
+     */
+    virtual void Reduce(const K2& key, const V2* begin, const V2* end,
+                        ReduceOutput& out) const = 0;
+
+    /**
+     * Runs the job.
+     * @param input
+     * @param multiThreadLevel number of map tasks and of reduce tasks, or
+     * AUTO_THREAD_LEVEL for one of each per CPU.
+     * @param grainSize the least number of items a map task claims at once,
+     * as JobOptions::grainSize.
+     * @return the output, sorted by k3.
+     */
+    OutputVec Run(const InputVec& input, int multiThreadLevel,
+                  unsigned long grainSize = 1) const
+    {
+        if (multiThreadLevel == AUTO_THREAD_LEVEL)
+        {
+            multiThreadLevel = GetProcessCpus();
+        }
+        Job job;
+        job.self = this;
+        job.input = &input;
+        job.cursor = 0;
+        job.grain = std::max(grainSize, 1UL);
+        job.tasks = multiThreadLevel;
+        // RunOnWorkers rejects a level below 1 before the vectors are used.
+        job.buckets.resize(std::max(multiThreadLevel, 0));
+        job.outputs.resize(std::max(multiThreadLevel, 0));
+        RunOnWorkers(multiThreadLevel, mapTask, &job);
+        RunOnWorkers(multiThreadLevel, reduceTask, &job);
+        // Merge the sorted outputs pairwise until one is left.
+        std::vector<OutputVec>& runs = job.outputs;
+        while (runs.size() > 1)
+        {
+            std::vector<OutputVec> merged((runs.size() + 1) / 2);
+            for (size_t i = 0; i + 1 < runs.size(); i += 2)
+            {
+                merged[i / 2].reserve(runs[i].size() + runs[i + 1].size());
+                std::merge(std::make_move_iterator(runs[i].begin()),
+                           std::make_move_iterator(runs[i].end()),
+                           std::make_move_iterator(runs[i + 1].begin()),
+                           std::make_move_iterator(runs[i + 1].end()),
+                           std::back_inserter(merged[i / 2]), lessOutput);
+            }
+            if (runs.size() % 2 == 1)
+            {
+                merged.back() = std::move(runs.back());
+            }
+            runs.swap(merged);
+        }
+        return runs.empty() ? OutputVec() : std::move(runs[0]);
+    }
+
+private:
+    /*
+     * The state of one Run, shared by its tasks.
+     */
+    struct Job {
+        const MapReduce* self;
+        const InputVec* input;
+        std::atomic<size_t> cursor;
+        size_t grain;
+        int tasks;
+        // buckets[map task][reduce task]
+        std::vector<std::vector<std::vector<std::pair<K2, V2>>>> buckets;
+        std::vector<OutputVec> outputs;
+    };
+
+    /*
+     * The values of one group, contiguous for Reduce. A std::vector would
+     * pack V2 = bool into bits, which have no pointer to pass.
+     */
+    class ValueBuffer {
+    public:
+        ValueBuffer(): values(NULL), size(0), capacity(0) {}
+
+        ~ValueBuffer()
+        {
+            reset(0);
+            if (values != NULL)
+            {
+                allocator.deallocate(values, capacity);
+            }
+        }
+
+        /**
+         * Destroys the values and makes room for needed new ones.
+         * @param needed
+         */
+        void reset(size_t needed)
+        {
+            for (size_t i = 0; i < size; i++)
+            {
+                values[i].~V2();
+            }
+            size = 0;
+            if (needed > capacity)
+            {
+                if (values != NULL)
+                {
+                    allocator.deallocate(values, capacity);
+                }
+                values = NULL;
+                capacity = 0;
+                values = allocator.allocate(needed);
+                capacity = needed;
+            }
+        }
+
+        void push(V2&& value)
+        {
+            new ((void*) (values + size)) V2(std::move(value));
+            size++;
+        }
+
+        const V2* begin() const
+        {
+            return values;
+        }
+
+        const V2* end() const
+        {
+            return values + size;
+        }
+
+    private:
+        ValueBuffer(const ValueBuffer&);
+        ValueBuffer& operator=(const ValueBuffer&);
+
+        std::allocator<V2> allocator;
+        V2* values;
+        size_t size;
+        size_t capacity;
+    };
+
+    static bool lessIntermediate(const std::pair<K2, V2>& first,
+                                 const std::pair<K2, V2>& second)
+    {
+        return Less2()(first.first, second.first);
+    }
+
+    static bool lessOutput(const std::pair<K3, V3>& first,
+                           const std::pair<K3, V3>& second)
+    {
+        return Less3()(first.first, second.first);
+    }
+
+    /**
+     * Maps guided chunks of the input, then splits the output of the task
+     * into one bucket per reduce task.
+     * @param arg the job.
+     * @param task
+     */
+    static void mapTask(void* arg, int task)
+    {
+        Job* job = (Job*) arg;
+        size_t size = job->input->size();
+        MapOutput out;
+        while (true)
+        {
+            size_t seen = job->cursor.load(std::memory_order_relaxed);
+            if (seen >= size)
+            {
+                break;
+            }
+            size_t chunk = std::max((size - seen) / (2 * job->tasks), job->grain);
+            size_t begin = job->cursor.fetch_add(chunk);
+            size_t end = std::min(begin + chunk, size);
+            for (size_t i = begin; i < end; i++)
+            {
+                const std::pair<K1, V1>& item = (*job->input)[i];
+                job->self->Map(item.first, item.second, out);
+            }
+        }
+        std::vector<std::vector<std::pair<K2, V2>>>& buckets = job->buckets[task];
+        buckets.resize(job->tasks);
+        Hash2 hash;
+        for (std::pair<K2, V2>& pair : out.pairs)
+        {
+            buckets[hash(pair.first) % job->tasks].push_back(std::move(pair));
+        }
+    }
+
+    /**
+     * Gathers one partition from all map tasks, sorts it, reduces every group
+     * of equal keys and sorts the output of the task.
+     * @param arg the job.
+     * @param task
+     */
+    static void reduceTask(void* arg, int task)
+    {
+        Job* job = (Job*) arg;
+        std::vector<std::pair<K2, V2>> partition;
+        for (int i = 0; i < job->tasks; i++)
+        {
+            std::vector<std::pair<K2, V2>>& bucket = job->buckets[i][task];
+            std::move(bucket.begin(), bucket.end(), std::back_inserter(partition));
+            std::vector<std::pair<K2, V2>>().swap(bucket);
+        }
+        std::sort(partition.begin(), partition.end(), lessIntermediate);
+        Less2 less;
+        ReduceOutput out;
+        ValueBuffer values;
+        for (size_t begin = 0; begin < partition.size();)
+        {
+            size_t end = begin + 1;
+            while (end < partition.size() &&
+                   !less(partition[begin].first, partition[end].first))
+            {
+                end++;
+            }
+            values.reset(end - begin);
+            for (size_t i = begin; i < end; i++)
+            {
+                values.push(std::move(partition[i].second));
+            }
+            job->self->Reduce(partition[begin].first, values.begin(),
+                              values.end(), out);
+            begin = end;
+        }
+        std::sort(out.pairs.begin(), out.pairs.end(), lessOutput);
+        job->outputs[task] = std::move(out.pairs);
+    }
+};
+
+#endif //EX3_MAPREDUCETYPED_H
@@ -4,36 +4,69 @@
 #include <sys/stat.h>
 #include <cstring>
 #include <dirent.h>
-#include <fstream>
-#include <sstream>
-#include <iterator>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
 #include <algorithm>
+#include <map>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "MapReduceClient.h"
 #include "MapReduceFramework.h"
+#include "MapReduceFrameworkExt.h"
 
-#define ERROR_ARGS "Usage: <substring to search> <folders, separated by space>"
-#define MINIMAL_ARGS 2
-#define SUBSTRING_ARG 1
-#define FOLDERS_ARG 2
-#define THREADS_POOL_SIZE 10
+#define ERROR_ARGS "Usage: [-c <cache folder>] [-g] [-v] " \
+                   "<substring to search> <folders, separated by space>"
+#define OPTIONS "+c:gv"
+#define CONTENTS_NAME "g"
+#define CACHED_ITEMS_MSG "Items read from the cache: "
+#define MINIMAL_ARGS 1
+#define SUBSTRING_ARG 0
+#define FOLDERS_ARG 1
 #define SPACE " "
+#define PATH_SEPARATOR "/"
+#define CURRENT_DIR "."
+#define PARENT_DIR ".."
+#define DIRENTS_BUFFER_SIZE 65536
+#define FOLDER_RANGE -1
+#define CONTENT_CHUNK_SIZE (4L << 20)
+#define NAME_MATCH 0
+#define LINE_SEPARATOR ":"
+#define NEW_LINE '\n'
+#define SIMD_WIDTH 16
 
 using namespace std;
 
+//a directory entry as getdents64 returns it, the name runs up to d_reclen.
+struct linuxDirent64
+{
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
 //input key and value.
-//the key, value for the map function and the MapReduceFramework
-class searchK1: public k1Base
+//the key, value for the map function and the MapReduceFramework. the key is
+//a folder, or a range of the bytes of a file when searching the contents.
+class searchK1: public k1Base, public Serializable
 {
-    char* folder_path;
-    char* substring_for_match;
+    string path;
+    const char* substring_for_match;
+    long range_begin;
+    long range_end;
 
 public:
-    searchK1(char* folder, char* substr): folder_path(folder),
-                                          substring_for_match(substr) {};
-    const char* getFolder() const
+    searchK1(string path, const char* substr, long begin = FOLDER_RANGE,
+             long end = FOLDER_RANGE): path(path), substring_for_match(substr),
+                                       range_begin(begin), range_end(end) {};
+    const char* getPath() const
     {
-        return this->folder_path;
+        return this->path.c_str();
     }
 
     const char* getSubstring() const
@@ -41,34 +74,62 @@ public:
         return this->substring_for_match;
     }
 
+    bool isFolder() const
+    {
+        return this->range_begin == FOLDER_RANGE;
+    }
+
+    long getBegin() const
+    {
+        return this->range_begin;
+    }
+
+    long getEnd() const
+    {
+        return this->range_end;
+    }
+
     bool operator<(const k1Base &other) const
     {
-        int res = strcmp(this->folder_path, ((searchK1&)other).getFolder());
-        return res < 0;
+        int res = strcmp(getPath(), ((searchK1&)other).getPath());
+        return res < 0 || (res == 0 &&
+                           this->range_begin < ((searchK1&)other).getBegin());
+    }
+
+    void Serialize(string& out) const
+    {
+        out.append((const char*)&this->range_begin, sizeof(this->range_begin));
+        out.append((const char*)&this->range_end, sizeof(this->range_end));
+        out.append(this->path);
     }
 };
 
 //intermediate key and value.
 //the key, value for the Reduce function created by the Map function
-class searchK2: public k2Base
+class searchK2: public k2Base, public Serializable
 {
-    const char* folder_path;
+    string folder_path;
 public:
-    searchK2(const char* folder): folder_path(folder) {};
+    searchK2(string folder): folder_path(folder) {};
 
     const char* getFolder() const
     {
-        return this->folder_path;
+        return this->folder_path.c_str();
     }
 
     bool operator<(const k2Base &other) const
     {
-        int res = strcmp(this->folder_path, ((searchK2&)other).getFolder());
+        int res = strcmp(getFolder(), ((searchK2&)other).getFolder());
         return res < 0;
     }
+
+    void Serialize(string& out) const
+    {
+        out.append(this->folder_path);
+    }
 };
 
-class searchV2: public v2Base
+class searchV2: public v2Base, public Serializable
 {
     string matched_file_name;
 public:
@@ -78,110 +139,539 @@ public:
     {
         return this->matched_file_name;
     }
+
+    void Serialize(string& out) const
+    {
+        out.append(this->matched_file_name);
+    }
+};
+
+//a line of a file that contains the substring, numbered from the start of
+//the chunk it was found in. the chunks of a file that has more than one also
+//give the number of lines they have, to number the lines of the chunks after.
+class searchLineV2: public v2Base, public Serializable
+{
+    long chunk_begin;
+    long line;
+    bool chunk_lines;
+public:
+    searchLineV2(long begin, long line, bool lines): chunk_begin(begin),
+                                                      line(line),
+                                                      chunk_lines(lines) {};
+
+    long getChunkBegin() const
+    {
+        return this->chunk_begin;
+    }
+
+    long getLine() const
+    {
+        return this->line;
+    }
+
+    bool isChunkLines() const
+    {
+        return this->chunk_lines;
+    }
+
+    void Serialize(string& out) const
+    {
+        out.append((const char*)&this->chunk_begin, sizeof(this->chunk_begin));
+        out.append((const char*)&this->line, sizeof(this->line));
+        out.append((const char*)&this->chunk_lines, sizeof(this->chunk_lines));
+    }
 };
 
 //output key and value
-//the key,value for the Reduce function created by the Map function
+//the key,value for the Reduce function created by the Map function. the key
+//is a file name, or a file and a line number when searching the contents.
 class searchK3: public k3Base
 {
     string matched_string;
+    long line;
 public:
-    searchK3(const char* str): matched_string(str) {};
+    searchK3(const char* str, long line = NAME_MATCH): matched_string(str),
+                                                       line(line) {};
 
     string getMatchedString() const
     {
         return this->matched_string;
     }
 
+    long getLine() const
+    {
+        return this->line;
+    }
+
     bool operator<(const k3Base &other) const
     {
         const char* this_str = matched_string.c_str();
-        searchK3 otherk3 = (searchK3&)other;
-        const char* other_str = otherk3.getMatchedString().c_str();
+        const char* other_str = ((searchK3&)other).matched_string.c_str();
         int res = strcmp(this_str, other_str);
-        return res < 0;
+        return res < 0 || (res == 0 && this->line < ((searchK3&)other).line);
     }
 };
 
-class searchMapReduce: public MapReduceBase
+class searchMapReduce: public MapReduceBase, public IdempotentMap,
+                       public InputFingerprint, public IntermediateFactory,
+                       public InputFactory
 {
+    const char* substring_for_match;
+    bool search_contents;
+
     /**
-     * checks if the file name and the given word is the same.
+     * checks if the file name contains the given word, on the bytes of the
+     * name as they are.
      * @param file_name
+     * @param name_size
      * @param substringToSearch
-     * @return true if they are equal, else false
+     * @param substring_size
+     * @return true if it does, else false
      */
-    bool isMatch(const char* file_name, const char* substringToSearch) const
+    bool isMatch(const char* file_name, size_t name_size,
+                 const char* substringToSearch, size_t substring_size) const
     {
-        string file_str(file_name);
-        string subStr(substringToSearch);
-        bool res = file_str.find(subStr) != string::npos;
-        return res;
+        return memmem(file_name, name_size, substringToSearch,
+                      substring_size) != NULL;
     }
 
     /**
-     * checks if it's directory.
-     * @param path
-     * @return true, else false.
+     * gives the type of an entry as the directory gives it, and with lstat
+     * only when it gives none. symbolic links are not followed so a link to a
+     * parent can't make the walk endless.
+     * @param dir_fd the directory of the entry.
+     * @param entry
+     * @return DT_DIR, DT_REG, or another type.
      */
-    bool isDir(const char* path) const
+    unsigned char entryType(int dir_fd, const linuxDirent64* entry) const
     {
+        if(entry->d_type != DT_UNKNOWN)
+        {
+            return entry->d_type;
+        }
         struct stat buf;
-        stat(path, &buf);
-        return S_ISDIR(buf.st_mode);
+        if(fstatat(dir_fd, entry->d_name, &buf, AT_SYMLINK_NOFOLLOW))
+        {
+            return DT_UNKNOWN;
+        }
+        return S_ISDIR(buf.st_mode) ? DT_DIR :
+               S_ISREG(buf.st_mode) ? DT_REG : DT_UNKNOWN;
     }
 
     /**
-     * checks if it's file.
-     * @param fileName
-     * @return true if it is, else false.
+     * checks if an entry is a directory to walk into.
+     * @param dir_fd the directory of the entry.
+     * @param entry
+     * @return true, else false.
      */
-    bool isFile(const char* fileName) const
+    bool isSubDir(int dir_fd, const linuxDirent64* entry) const
     {
-        ifstream infile(fileName);
-        return infile.good();
+        if(strcmp(entry->d_name, CURRENT_DIR) == 0 ||
+           strcmp(entry->d_name, PARENT_DIR) == 0)
+        {
+            return false;
+        }
+        return entryType(dir_fd, entry) == DT_DIR;
     }
 
-public:
     /**
-     * Opens the directory (if it is) and goes over the files, searchs fot the
-     * files names that contains the given string, when finds creates a key2
-     * with the folder nams, and the values are the correct files names.
-     * @param key
-     * @param val
+     * finds the first place of the substring in the text. SIMD_WIDTH places
+     * are tried at once: only the ones whose first and last bytes both are
+     * the ones of the substring are compared in full.
+     * @param text
+     * @param size
+     * @param substring
+     * @param substring_size
+     * @return the place, or null if there is none.
      */
-    void Map(const k1Base *const key, const v1Base *const val) const
+    const char* findSubstring(const char* text, size_t size,
+                              const char* substring,
+                              size_t substring_size) const
     {
-        if(val)
+        if(substring_size == 0)
+        {
+            return text;
+        }
+        size_t i = 0;
+#ifdef __SSE2__
+        const __m128i first = _mm_set1_epi8(substring[0]);
+        const __m128i last = _mm_set1_epi8(substring[substring_size - 1]);
+        for(; i + substring_size - 1 + SIMD_WIDTH <= size; i += SIMD_WIDTH)
+        {
+            __m128i first_bytes = _mm_loadu_si128((const __m128i*)(text + i));
+            __m128i last_bytes = _mm_loadu_si128(
+                    (const __m128i*)(text + i + substring_size - 1));
+            unsigned int candidates = _mm_movemask_epi8(_mm_and_si128(
+                    _mm_cmpeq_epi8(first, first_bytes),
+                    _mm_cmpeq_epi8(last, last_bytes)));
+            while(candidates != 0)
+            {
+                const char* place = text + i + __builtin_ctz(candidates);
+                if(memcmp(place, substring, substring_size) == 0)
+                {
+                    return place;
+                }
+                candidates &= candidates - 1;
+            }
+        }
+#endif
+        if(i >= size)
         {
+            return NULL;
+        }
+        return (const char*)memmem(text + i, size - i, substring,
+                                   substring_size);
+    }
 
+    /**
+     * @param text
+     * @param size
+     * @return the number of new lines in the text.
+     */
+    long countLines(const char* text, size_t size) const
+    {
+        long lines = 0;
+        size_t i = 0;
+#ifdef __SSE2__
+        const __m128i new_line = _mm_set1_epi8(NEW_LINE);
+        for(; i + SIMD_WIDTH <= size; i += SIMD_WIDTH)
+        {
+            __m128i bytes = _mm_loadu_si128((const __m128i*)(text + i));
+            lines += __builtin_popcount(
+                    _mm_movemask_epi8(_mm_cmpeq_epi8(new_line, bytes)));
+        }
+#endif
+        for(; i < size; i++)
+        {
+            lines += text[i] == NEW_LINE;
         }
+        return lines;
+    }
+
+    /**
+     * goes over the files of a folder, searchs fot the files names that
+     * contains the given string, when finds creates a key2 with the folder
+     * nams, and the values are the correct files names. when searching the
+     * contents, every file is added to the input with Emit1 instead. Every
+     * subdirectory is added to the input with Emit1, so the free mappers walk
+     * it while this one goes on. The entries are read straight from the
+     * kernel in big batches, without a stat or an allocation per entry.
+     * @param searchKey
+     */
+    void mapFolder(const searchK1* searchKey) const
+    {
         searchK2* folderK2;
         searchV2* matchedFileV2;
-        searchK1* searchKey = (searchK1*)key;
         const char* substringToSearch = searchKey->getSubstring();
-        const char* path = searchKey->getFolder();
-        if(isDir(path))
+        size_t substring_size = strlen(substringToSearch);
+        const char* path = searchKey->getPath();
+        int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(dir_fd < 0)
         {
-            DIR* dir;
-            struct dirent* file;
-
-            if ((dir = opendir(path)) != NULL)
+            return;
+        }
+        alignas(linuxDirent64) char entries[DIRENTS_BUFFER_SIZE];
+        long entries_size;
+        while((entries_size = syscall(SYS_getdents64, dir_fd, entries,
+                                      sizeof(entries))) > 0)
+        {
+            long offset = 0;
+            while(offset < entries_size)
             {
-                while ((file = readdir(dir)) != NULL)
+                linuxDirent64* entry = (linuxDirent64*)(entries + offset);
+                offset += entry->d_reclen;
+                if(this->search_contents)
+                {
+                    if(entryType(dir_fd, entry) == DT_REG)
+                    {
+                        // The first chunk adds the others once it knows the
+                        // size, so the walk needs no stat.
+                        string file_path = string(path) + PATH_SEPARATOR +
+                                           entry->d_name;
+                        Emit1(new searchK1(file_path, substringToSearch, 0,
+                                           CONTENT_CHUNK_SIZE), nullptr);
+                    }
+                }
+                else
                 {
-                    if(isMatch(file->d_name, substringToSearch))
+                    size_t name_size = strlen(entry->d_name);
+                    if(isMatch(entry->d_name, name_size, substringToSearch,
+                               substring_size))
                     {
-                        string file_name(file->d_name);
-                        matchedFileV2 = new searchV2(file_name);
-                        folderK2 = new searchK2(path);
+                        string file_name(entry->d_name, name_size);
+                        matchedFileV2 = MapReduceAlloc<searchV2>(file_name);
+                        folderK2 = MapReduceAlloc<searchK2>(path);
                         Emit2(folderK2, matchedFileV2);
                     }
                 }
-                closedir(dir);
+                if(isSubDir(dir_fd, entry))
+                {
+                    string sub_path = string(path) + PATH_SEPARATOR +
+                                      entry->d_name;
+                    Emit1(new searchK1(sub_path, substringToSearch), nullptr);
+                }
             }
         }
-        delete(key);
+        close(dir_fd);
+    }
+
+    /**
+     * maps a range of a file and finds the lines in it that contain the
+     * given string, a key2 with the file name is created for each of them.
+     * a match that starts in the range is found even if it ends after it.
+     * the first range of a big file adds the other ranges with Emit1.
+     * @param searchKey
+     */
+    void mapFileRange(const searchK1* searchKey) const
+    {
+        const char* substringToSearch = searchKey->getSubstring();
+        size_t substring_size = strlen(substringToSearch);
+        const char* path = searchKey->getPath();
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+        {
+            return;
+        }
+        struct stat buf;
+        long begin = searchKey->getBegin();
+        if(fstat(fd, &buf) || begin >= buf.st_size)
+        {
+            close(fd);
+            return;
+        }
+        long file_size = buf.st_size;
+        if(begin == 0)
+        {
+            for(long next = CONTENT_CHUNK_SIZE; next < file_size;
+                next += CONTENT_CHUNK_SIZE)
+            {
+                Emit1(new searchK1(path, substringToSearch, next,
+                                   next + CONTENT_CHUNK_SIZE), nullptr);
+            }
+        }
+        long end = min(searchKey->getEnd(), file_size);
+        long map_begin = begin - begin % sysconf(_SC_PAGESIZE);
+        long map_end = min(end + max((long) substring_size - 1, 0L),
+                           file_size);
+        void* mapped = mmap(NULL, map_end - map_begin, PROT_READ, MAP_PRIVATE,
+                            fd, map_begin);
+        close(fd);
+        if(mapped == MAP_FAILED)
+        {
+            return;
+        }
+        madvise(mapped, map_end - map_begin, MADV_SEQUENTIAL);
+        const char* text = (const char*)mapped + (begin - map_begin);
+        size_t range_size = end - begin;
+        size_t text_size = map_end - begin;
+        long lines = 0;
+        size_t counted = 0;
+        size_t place = 0;
+        const char* match;
+        while(place < range_size &&
+              (match = findSubstring(text + place, text_size - place,
+                                     substringToSearch, substring_size)) &&
+              (size_t)(match - text) < range_size)
+        {
+            lines += countLines(text + counted, match - text - counted);
+            counted = match - text;
+            Emit2(MapReduceAlloc<searchK2>(path),
+                  MapReduceAlloc<searchLineV2>(begin, lines + 1, false));
+            // The line is printed once, however many matches it has.
+            const char* line_end = (const char*)memchr(match, NEW_LINE,
+                                                       range_size - counted);
+            place = line_end == NULL ? range_size : line_end - text + 1;
+        }
+        if(file_size > CONTENT_CHUNK_SIZE)
+        {
+            lines += countLines(text + counted, range_size - counted);
+            Emit2(MapReduceAlloc<searchK2>(path),
+                  MapReduceAlloc<searchLineV2>(begin, lines, true));
+        }
+        munmap(mapped, map_end - map_begin);
+    }
+
+public:
+    /**
+     * Constructor.
+     * @param substr the substring of every key.
+     * @param contents true to search the contents of the files instead of
+     * their names.
+     */
+    searchMapReduce(const char* substr, bool contents):
+            substring_for_match(substr), search_contents(contents) {};
+
+    /**
+     * names the item by its folder or file range and substring, and
+     * fingerprints it by the inode, size and modification time of the folder,
+     * which change whenever a file is added to it, removed or renamed, or of
+     * the file.
+     * @param key
+     * @param val
+     * @param name
+     * @param fingerprint
+     * @return false if the folder can't be stat'ed.
+     */
+    bool Fingerprint(const k1Base *const key, const v1Base *const val,
+                     string& name, string& fingerprint) const
+    {
+        if(val)
+        {
+
+        }
+        searchK1* searchKey = (searchK1*)key;
+        struct stat buf;
+        if (stat(searchKey->getPath(), &buf))
+        {
+            return false;
+        }
+        name = searchKey->getPath();
+        name.push_back('\0');
+        name.append(searchKey->getSubstring());
+        if (this->search_contents)
+        {
+            name.push_back('\0');
+            name.append(CONTENTS_NAME);
+        }
+        if (!searchKey->isFolder())
+        {
+            name.push_back('\0');
+            name.append(to_string(searchKey->getBegin()));
+        }
+        fingerprint = to_string(buf.st_ino) + SPACE + to_string(buf.st_size) +
+                      SPACE + to_string(buf.st_mtim.tv_sec) + SPACE +
+                      to_string(buf.st_mtim.tv_nsec);
+        return true;
+    }
+
+    /**
+     * rebuilds a folder or file range key that Map added, from the map cache.
+     * @param data
+     * @param size
+     * @return the key.
+     */
+    k1Base* DeserializeK1(const char* data, size_t size) const
+    {
+        long begin;
+        long end;
+        memcpy(&begin, data, sizeof(begin));
+        memcpy(&end, data + sizeof(begin), sizeof(end));
+        size_t path_offset = sizeof(begin) + sizeof(end);
+        return new searchK1(string(data + path_offset, size - path_offset),
+                            this->substring_for_match, begin, end);
+    }
+
+    /**
+     * the keys that Map adds have no value.
+     * @param data
+     * @param size
+     * @return null.
+     */
+    v1Base* DeserializeV1(const char* data, size_t size) const
+    {
+        if(data && size)
+        {
+
+        }
+        return nullptr;
+    }
+
+    /**
+     * rebuilds a folder key from the map cache.
+     * @param data
+     * @param size
+     * @return the key.
+     */
+    k2Base* DeserializeK2(const char* data, size_t size) const
+    {
+        return new searchK2(string(data, size));
+    }
+
+    /**
+     * rebuilds a file name value, or a line value, from the map cache.
+     * @param data
+     * @param size
+     * @return the value.
+     */
+    v2Base* DeserializeV2(const char* data, size_t size) const
+    {
+        if(!this->search_contents)
+        {
+            return new searchV2(string(data, size));
+        }
+        long begin;
+        long line;
+        bool lines;
+        memcpy(&begin, data, sizeof(begin));
+        memcpy(&line, data + sizeof(begin), sizeof(line));
+        memcpy(&lines, data + sizeof(begin) + sizeof(line), sizeof(lines));
+        return new searchLineV2(begin, line, lines);
+    }
+
+    /**
+     * searchs a folder or a range of a file, as the key is.
+     * @param key
+     * @param val
+     */
+    void Map(const k1Base *const key, const v1Base *const val) const
+    {
+        if(val)
+        {
+
+        }
+        searchK1* searchKey = (searchK1*)key;
+        if(searchKey->isFolder())
+        {
+            mapFolder(searchKey);
+        }
+        else
+        {
+            mapFileRange(searchKey);
+        }
+    }
+
+    /**
+     * numbers the lines of a file that were found in its ranges from the
+     * start of the file, and calls to Emit3 with the file and each line once.
+     * @param key
+     * @param vals
+     */
+    void reduceLines(const k2Base *const key, const V2_VEC &vals) const
+    {
+        map<long, long> lines_before;
+        vector<pair<long, long>> found;
+        for(v2Base* val : vals)
+        {
+            searchLineV2* line = (searchLineV2*)val;
+            if(line->isChunkLines())
+            {
+                lines_before[line->getChunkBegin()] = line->getLine();
+            }
+            else
+            {
+                found.push_back(make_pair(line->getChunkBegin(),
+                                          line->getLine()));
+            }
+        }
+        long lines = 0;
+        for(pair<const long, long>& chunk : lines_before)
+        {
+            long chunk_lines = chunk.second;
+            chunk.second = lines;
+            lines += chunk_lines;
+        }
+        vector<long> numbers;
+        for(pair<long, long>& line : found)
+        {
+            numbers.push_back(lines_before[line.first] + line.second);
+        }
+        sort(numbers.begin(), numbers.end());
+        numbers.erase(unique(numbers.begin(), numbers.end()), numbers.end());
+        const char* path = ((searchK2*)key)->getFolder();
+        for(long number : numbers)
+        {
+            Emit3(new searchK3(path, number), nullptr);
+        }
     }
 
     /**
@@ -192,9 +682,10 @@ public:
      */
     void Reduce(const k2Base *const key, const V2_VEC &vals) const
     {
-        if(key)
+        if(this->search_contents)
         {
-
+            reduceLines(key, vals);
+            return;
         }
         string matched_string;
         const char* matched_char_arr;
@@ -209,61 +700,107 @@ public:
     }
 };
 
-/**
- * extract the file names from the result that the framework returns.
- * @param outItemsVector
- * @return vector of the names
+/*
+ * Prints the file names as the framework merges them, in sorted order, or
+ * the file and line of every line found, one per line.
  */
-vector<string> extractStrings(OUT_ITEMS_VEC outItemsVector)
+class printMatches: public OutputSink
 {
-    std::vector <std::string> strings_vec;
-    for (OUT_ITEMS_VEC::const_iterator it = outItemsVector.begin(),
-                 end = outItemsVector.end(); it != end; ++it) {
-        searchK3* filesInFolder = (searchK3*)it->first;
-        string str(filesInFolder->getMatchedString()) ;
-        std::istringstream iss(str);
-        std::copy(std::istream_iterator<std::string>(iss),
-                  std::istream_iterator<std::string>(),
-                  std::back_inserter(strings_vec));
-        delete(it->first);
-    }
-    return strings_vec;
-}
+public:
+    /**
+     * prints the name of the file, or the file and the line, and releases
+     * the key.
+     * @param key
+     * @param value
+     */
+    void Write(k3Base* key, v3Base* value)
+    {
+        if(value)
+        {
+
+        }
+        searchK3* match = (searchK3*)key;
+        if(match->getLine() == NAME_MATCH)
+        {
+            std::cout << match->getMatchedString() << SPACE;
+        }
+        else
+        {
+            std::cout << match->getMatchedString() << LINE_SEPARATOR
+                      << match->getLine() << NEW_LINE;
+        }
+        delete(key);
+    }
+};
 
 /**
  * runs the programm with the given string, and the paths, ans searchs if their
- * is file name with this string, if it is exist prints the name of the file.
- * if the number if the arguments not correct' returns an error.
+ * is file name with this string in them or in the folders under them, if it
+ * is exist prints the name of the file.
+ * if the number if the arguments not correct' returns an error. with -c the
+ * files found in every folder are kept in the cache folder, and the next runs
+ * read only the folders that changed. with -g the contents of the files are
+ * searched instead, and every line that contains the string is printed as
+ * file:line. with -v the number of folders and files that were read from
+ * the cache instead is printed to the error output.
  * @param argc
  * @param argv
  * @return
  */
 int main(int argc, char *argv[])
 {
-    if (argc < MINIMAL_ARGS)
+    JobOptions options;
+    bool search_contents = false;
+    bool verbose = false;
+    int opt;
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1)
+    {
+        if (opt == 'g')
+        {
+            search_contents = true;
+        }
+        else if (opt == 'c')
+        {
+            options.cacheDirectory = optarg;
+        }
+        else if (opt == 'v')
+        {
+            verbose = true;
+        }
+        else
+        {
+            cerr << ERROR_ARGS << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (argc - optind < MINIMAL_ARGS)
     {
         cerr << ERROR_ARGS << endl;
         exit(EXIT_FAILURE);
     }
 
-    char* substringToSearch = argv[SUBSTRING_ARG];
+    char* substringToSearch = argv[optind + SUBSTRING_ARG];
     IN_ITEMS_VEC k1v1_vec;
 
-    for(int i = FOLDERS_ARG; i < argc; i++)
+    for(int i = optind + FOLDERS_ARG; i < argc; i++)
     {
         searchK1* k1 = new searchK1(argv[i], substringToSearch);
         IN_ITEM pair(k1, nullptr);
         k1v1_vec.push_back(pair);
     }
-    searchMapReduce mapReduceSearch;
-    OUT_ITEMS_VEC out_items_vec = RunMapReduceFramework
-            (mapReduceSearch, k1v1_vec, THREADS_POOL_SIZE, true);
-    vector<string> k3_vals =  extractStrings(out_items_vec);
-    std::sort(k3_vals.begin(), k3_vals.end());
-    for (std::vector<std::string>::const_iterator it = k3_vals.begin();
-         it != k3_vals.end(); ++ it)
+    searchMapReduce mapReduceSearch(substringToSearch, search_contents);
+    printMatches matchesSink;
+    options.outputSink = &matchesSink;
+    RunMapReduceFramework(mapReduceSearch, k1v1_vec, AUTO_THREAD_LEVEL, true,
+                          options);
+    if (verbose)
+    {
+        cerr << CACHED_ITEMS_MSG << GetLastJobStats().cachedItems << endl;
+    }
+    // A folder may be read more than once, so its key lives until the end.
+    for(IN_ITEM& pair : k1v1_vec)
     {
-        std::cout << *it << SPACE;
+        delete(pair.first);
     }
     return 0;
 }
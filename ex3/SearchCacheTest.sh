@@ -0,0 +1,52 @@
+#!/bin/sh
+# Runs Search twice with a cache folder, and checks that the second run reads
+# every folder from the cache, and that a run after one folder changed reads
+# only that folder again. Used by make test.
+
+SEARCH=${SEARCH:-./Search}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+fail()
+{
+    echo "SearchCacheTest Failure: $1" >&2
+    exit 1
+}
+
+# Prints the sorted output of a Search run, and keeps the number of items it
+# read from the cache in $WORK/cached.
+search()
+{
+    "$SEARCH" -v -c "$WORK/cache" "$@" 2> "$WORK/err" | tr ' ' '\n' | \
+        grep -v '^$' | sort
+    sed -n 's/^Items read from the cache: //p' "$WORK/err" > "$WORK/cached"
+}
+
+mkdir -p "$WORK/cache" "$WORK/tree/a/b/c" "$WORK/tree/a/d" "$WORK/tree/e"
+touch "$WORK/tree/xabc" "$WORK/tree/a/abc1" "$WORK/tree/a/b/c/abc2" \
+      "$WORK/tree/e/other"
+echo "abc here" > "$WORK/tree/a/d/abc3"
+FOLDERS=$(find "$WORK/tree" -type d | wc -l)
+
+FIRST=$(search abc "$WORK/tree")
+[ "$(cat "$WORK/cached")" = 0 ] || fail "first run used the cache"
+SECOND=$(search abc "$WORK/tree")
+[ "$SECOND" = "$FIRST" ] || fail "cached output differs"
+[ "$(cat "$WORK/cached")" = "$FOLDERS" ] || \
+    fail "$(cat "$WORK/cached") of $FOLDERS folders read from the cache"
+
+touch "$WORK/tree/a/b/abc4"
+THIRD=$(search abc "$WORK/tree")
+echo "$THIRD" | grep -qx abc4 || fail "new file not found"
+[ "$(cat "$WORK/cached")" = $((FOLDERS - 1)) ] || \
+    fail "changed folder not read again"
+
+# The contents mode caches the folders and the files.
+search -g abc "$WORK/tree" > /dev/null
+GREP=$(search -g abc "$WORK/tree")
+echo "$GREP" | grep -q "abc3:1" || fail "content match not found"
+FILES=$(find "$WORK/tree" -type f | wc -l)
+[ "$(cat "$WORK/cached")" = $((FOLDERS + FILES)) ] || \
+    fail "contents not read from the cache"
+
+echo "SearchCacheTest passed"
@@ -0,0 +1,279 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <stdlib.h>
+#include <stdio.h>
+#include "MapReduceClient.h"
+#include "MapReduceFramework.h"
+#include "MapReduceFrameworkExt.h"
+#include "MapReduceTyped.h"
+
+#define LINES_NUM 5000
+#define WORDS_PER_LINE 16
+#define VOCABULARY_SIZE 2000
+#define RANDOM_SEED 12345
+#define ERROR_MSG_A "TypedTest Failure: "
+#define ERROR_MSG_B " failed."
+#define ERROR_WORD_COUNT "typed word count same as the pointer API"
+#define ERROR_ODD_WORDS "typed job with bool values"
+
+using namespace std;
+
+typedef vector<int> Line;
+
+//input key and value of the pointer API.
+class testLine: public k1Base
+{
+    Line words;
+    int line_id;
+public:
+    testLine(const Line& words, int id): words(words), line_id(id) {};
+
+    const Line& getWords() const
+    {
+        return this->words;
+    }
+
+    int getLineId() const
+    {
+        return this->line_id;
+    }
+
+    bool operator<(const k1Base &other) const
+    {
+        return this->line_id < ((testLine&)other).getLineId();
+    }
+};
+
+//intermediate key and value.
+class testK2: public k2Base
+{
+    int key;
+public:
+    testK2(int k): key(k) {};
+
+    int getKey() const
+    {
+        return this->key;
+    }
+
+    bool operator<(const k2Base &other) const
+    {
+        return this->key < ((testK2&)other).getKey();
+    }
+};
+
+class testV2: public v2Base
+{
+};
+
+//output key and value
+class testK3: public k3Base
+{
+    int key;
+public:
+    testK3(int k): key(k) {};
+
+    int getKey() const
+    {
+        return this->key;
+    }
+
+    bool operator<(const k3Base &other) const
+    {
+        return this->key < ((testK3&)other).getKey();
+    }
+};
+
+class testV3: public v3Base
+{
+    long value;
+public:
+    testV3(long v): value(v) {};
+
+    long getValue() const
+    {
+        return this->value;
+    }
+};
+
+/*
+ * Counts every word of every line with the pointer API.
+ */
+class wordCount: public MapReduceBase
+{
+public:
+    void Map(const k1Base *const key, const v1Base *const val) const
+    {
+        if(val)
+        {
+
+        }
+        for (int word : ((testLine*)key)->getWords())
+        {
+            Emit2(MapReduceAlloc<testK2>(word), MapReduceAlloc<testV2>());
+        }
+    }
+
+    void Reduce(const k2Base *const key, const V2_VEC &vals) const
+    {
+        Emit3(new testK3(((testK2*)key)->getKey()), new testV3(vals.size()));
+    }
+};
+
+/*
+ * Counts every word of every line with the typed front-end.
+ */
+class typedWordCount: public MapReduce<int, Line, int, int, int, long>
+{
+public:
+    void Map(const int& key, const Line& value, MapOutput& out) const
+    {
+        if(key)
+        {
+
+        }
+        for (int word : value)
+        {
+            out.Emit(word, 1);
+        }
+    }
+
+    void Reduce(const int& key, const int* begin, const int* end,
+                ReduceOutput& out) const
+    {
+        long count = 0;
+        for (const int* value = begin; value != end; value++)
+        {
+            count += *value;
+        }
+        out.Emit(key, count);
+    }
+};
+
+/*
+ * Finds the words that appear in a line with an odd number, with bool
+ * values, which a std::vector would not keep contiguous.
+ */
+class oddWords: public MapReduce<int, Line, int, bool, int, bool>
+{
+public:
+    void Map(const int& key, const Line& value, MapOutput& out) const
+    {
+        for (int word : value)
+        {
+            out.Emit(word, key % 2 == 1);
+        }
+    }
+
+    void Reduce(const int& key, const bool* begin, const bool* end,
+                ReduceOutput& out) const
+    {
+        bool odd = false;
+        for (const bool* value = begin; value != end; value++)
+        {
+            odd = odd || *value;
+        }
+        out.Emit(key, odd);
+    }
+};
+
+/**
+ * Prints the failure and exits.
+ * @param what
+ */
+void fail(const char* what)
+{
+    cerr << ERROR_MSG_A << what << ERROR_MSG_B << endl;
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Runs the word count with the pointer API and with the typed front-end and
+ * compares the outputs, then runs a typed job with bool values.
+ * @param threads
+ * @param lines
+ */
+void runJobs(int threads, const vector<Line>& lines)
+{
+    IN_ITEMS_VEC input;
+    typedWordCount::InputVec typed_input;
+    for (size_t i = 0; i < lines.size(); i++)
+    {
+        input.push_back(IN_ITEM(new testLine(lines[i], i), nullptr));
+        typed_input.push_back(make_pair((int) i, lines[i]));
+    }
+    wordCount word_count;
+    OUT_ITEMS_VEC output = RunMapReduceFramework(word_count, input, threads,
+                                                 true);
+    typedWordCount typed_word_count;
+    typedWordCount::OutputVec typed_output = typed_word_count.Run(typed_input,
+                                                                  threads);
+    if (output.size() != typed_output.size())
+    {
+        fail(ERROR_WORD_COUNT);
+    }
+    for (size_t i = 0; i < output.size(); i++)
+    {
+        if (((testK3*)output[i].first)->getKey() != typed_output[i].first ||
+            ((testV3*)output[i].second)->getValue() != typed_output[i].second)
+        {
+            fail(ERROR_WORD_COUNT);
+        }
+    }
+    vector<bool> expected(VOCABULARY_SIZE, false);
+    for (size_t i = 0; i < lines.size(); i++)
+    {
+        for (int word : lines[i])
+        {
+            expected[word] = expected[word] || i % 2 == 1;
+        }
+    }
+    oddWords odd_words;
+    oddWords::OutputVec odd_output = odd_words.Run(typed_input, threads);
+    if (odd_output.size() != output.size())
+    {
+        fail(ERROR_ODD_WORDS);
+    }
+    for (const pair<int, bool>& item : odd_output)
+    {
+        if (item.second != expected[item.first])
+        {
+            fail(ERROR_ODD_WORDS);
+        }
+    }
+    for (OUT_ITEM& item : output)
+    {
+        delete item.first;
+        delete item.second;
+    }
+    for (IN_ITEM& item : input)
+    {
+        delete item.first;
+    }
+}
+
+/**
+ * Checks that the typed front-end gives the same output as the pointer API,
+ * with a few thread levels. Used by make test.
+ * @return
+ */
+int main()
+{
+    mt19937 generator(RANDOM_SEED);
+    uniform_int_distribution<int> word(0, VOCABULARY_SIZE - 1);
+    vector<Line> lines(LINES_NUM);
+    for (Line& line : lines)
+    {
+        for (int j = 0; j < WORDS_PER_LINE; j++)
+        {
+            line.push_back(word(generator));
+        }
+    }
+    runJobs(1, lines);
+    runJobs(3, lines);
+    runJobs(AUTO_THREAD_LEVEL, lines);
+    ReleaseMapReduceFramework();
+    printf("TypedTest passed\n");
+    return 0;
+}